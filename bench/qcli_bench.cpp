@@ -0,0 +1,192 @@
+/**
+ * @ Author: luoqi
+ * @ Create Time: 2026-10-19 10:00
+ * @ Modified by: luoqi
+ * @ Modified time: 2026-10-19 13:00
+ * @ Description: Timings of the registration, output and script paths, fails on wrong results
+ */
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "qshell.h"
+
+static size_t out_bytes;
+static long calls;
+
+// Counts the output instead of writing it, the shell hands raw bytes over as "%.*s"
+static int sink(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n;
+    if(strcmp(fmt, "%.*s") == 0) {
+        n = va_arg(args, int);
+        (void)va_arg(args, const char *);
+    } else {
+        n = vsnprintf(nullptr, 0, fmt, args);
+    }
+    va_end(args);
+    out_bytes += n;
+    return n;
+}
+
+static int tick(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    calls++;
+    return 0;
+}
+
+class Timer {
+public:
+    explicit Timer(const char *name) : name(name), t0(std::chrono::steady_clock::now()) {}
+
+    ~Timer()
+    {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        printf(" %-32s %10.1f ms\r\n", name, ms);
+    }
+
+private:
+    const char *name;
+    std::chrono::steady_clock::time_point t0;
+};
+
+static int failed;
+
+static void check(bool ok, const char *what)
+{
+    if(!ok) {
+        printf(" FAIL: %s\r\n", what);
+        failed++;
+    }
+}
+
+// cmd_add() and cmd_del() one by one
+static void bench_register(QShell &sh, size_t n, const char *add_name, const char *del_name)
+{
+    std::vector<std::string> names(n);
+    for(size_t i = 0; i < n; i++) {
+        names[i] = "reg" + std::to_string(i);
+    }
+    int errs = 0;
+    {
+        Timer t(add_name);
+        for(size_t i = 0; i < n; i++) {
+            errs += sh.cmd_add(names[i].c_str(), tick, "bench") != QCLI_EOK;
+        }
+    }
+    calls = 0;
+    check(errs == 0 && sh.xstr(names[n - 1].c_str()) == QCLI_EOK && calls == 1, "register");
+    {
+        Timer t(del_name);
+        for(size_t i = 0; i < n; i++) {
+            errs += sh.cmd_del(names[i].c_str()) != QCLI_EOK;
+        }
+    }
+    calls = 0;
+    sh.xstr(names[0].c_str());
+    check(errs == 0 && calls == 0, "remove");
+}
+
+// cmd_add_many() of top-level commands with a subcommand each
+static void bench_bulk(QShell &sh, size_t n)
+{
+    std::vector<std::string> names(n / 2);
+    std::vector<QcliDesc> descs;
+    descs.reserve(n);
+    for(size_t i = 0; i < n / 2; i++) {
+        names[i] = "bulk" + std::to_string(i);
+        descs.push_back({ nullptr, names[i].c_str(), tick, "bench" });
+        descs.push_back({ names[i].c_str(), "sub", tick, "bench" });
+    }
+    int added;
+    {
+        Timer t("bulk load 50k");
+        added = sh.cmd_add_many(descs.data(), descs.size());
+    }
+    calls = 0;
+    std::string line = names[n / 4] + " sub";
+    check(added == (int)descs.size() && sh.xstr(line.c_str()) == QCLI_EOK && calls == 1, "bulk load");
+    for(size_t i = 0; i < n / 2; i++) {
+        sh.cmd_del(names[i].c_str());
+    }
+}
+
+// Every bulk load leaves a slab of its own, releasing a node must not depend on their number. A new shell, so
+// that the slabs of single commands come after them.
+static void bench_slabs(size_t slabs, size_t n)
+{
+    std::vector<std::string> names(slabs);
+    QShell sh(sink, nullptr);
+    for(size_t i = 0; i < slabs; i++) {
+        names[i] = "slab" + std::to_string(i);
+        QcliDesc desc = { nullptr, names[i].c_str(), tick, "bench" };
+        sh.cmd_add_many(&desc, 1);
+    }
+    bench_register(sh, n, "register 100k, 2000 slabs", "remove 100k, 2000 slabs");
+    for(size_t i = 0; i < slabs; i++) {
+        sh.cmd_del(names[i].c_str());
+    }
+}
+
+// tprint() against print(), which formats with vsnprintf
+static void bench_print(QShell &sh, int n)
+{
+    out_bytes = 0;
+    {
+        Timer t("print (vsnprintf) 1M");
+        for(int i = 0; i < n; i++) {
+            sh.print("speed %d rpm, load %.2f, %s\r\n", i, i * 0.01, "ok");
+        }
+    }
+    size_t vs = out_bytes;
+    out_bytes = 0;
+    {
+        Timer t("tprint 1M");
+        for(int i = 0; i < n; i++) {
+            sh.tprint("speed {} rpm, load {:.2}, {}\r\n", i, i * 0.01, "ok");
+        }
+    }
+    check(vs == out_bytes, "tprint output differs from print");
+}
+
+// run_script() of a million lines
+static void bench_script(QShell &sh, int n)
+{
+    sh.cmd_add("tick", tick, "bench");
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "qcli_bench_script.txt";
+    {
+        std::ofstream f(path, std::ios::binary);
+        for(int i = 0; i < n; i++) {
+            f << "tick " << i << " arg\n";
+        }
+    }
+    calls = 0;
+    int ret;
+    {
+        Timer t("script 1M lines");
+        ret = sh.run_script(path.string().c_str());
+    }
+    std::filesystem::remove(path);
+    check(ret == QCLI_EOK && calls == n, "script");
+    sh.cmd_del("tick");
+}
+
+int main()
+{
+    QShell sh(sink, nullptr);
+    bench_register(sh, 100000, "register 100k", "remove 100k");
+    bench_bulk(sh, 50000);
+    bench_slabs(2000, 100000);
+    bench_print(sh, 1000000);
+    bench_script(sh, 1000000);
+    return failed == 0 ? 0 : 1;
+}
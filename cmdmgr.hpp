@@ -7,9 +7,35 @@
  */
 
 #pragma once
+#include <functional>
 #include <vector>
 #include "qshell.h"
 
+// Setup of a registered command, placed in the qcli_ext linker section in section mode
+// A table binds to command `name`, a non-zero ttl_ms caches the command's output, see QShell::cmd_cache()
+struct CmdDesc {
+    const char *parent;
+    const char *name;
+    QcliTable *table;
+    size_t table_size;
+    uint32_t ttl_ms;
+};
+
+/* CMDMGR_USE_SECTION: no static constructors and no heap, CmdMgr::init walks the sections once.
+ * CMD_REGIST places a QcliDesc in qcli_cmd and its node in qcli_node, the core sorts the descriptors in place
+ * and links the nodes, tables and caches come from qcli_ext and VAR_REGIST places a QShellVarDesc in qcli_var.
+ * Requires GCC/Clang and an ELF linker, which provides the __start_/__stop_ section symbols. */
+#ifdef CMDMGR_USE_SECTION
+extern QcliDesc __start_qcli_cmd[] __attribute__((weak));
+extern QcliDesc __stop_qcli_cmd[] __attribute__((weak));
+extern QcliCmd __start_qcli_node[] __attribute__((weak));
+extern QcliCmd __stop_qcli_node[] __attribute__((weak));
+extern const CmdDesc __start_qcli_ext[] __attribute__((weak));
+extern const CmdDesc __stop_qcli_ext[] __attribute__((weak));
+extern const QShellVarDesc __start_qcli_var[] __attribute__((weak));
+extern const QShellVarDesc __stop_qcli_var[] __attribute__((weak));
+#endif
+
 class CmdMgr {
 public:
 private:
@@ -19,10 +45,14 @@ private:
         std::string name;
         Callback cb;
         std::string help;
+        QcliTable *table{ nullptr };
+        size_t table_size{ 0 };
+        uint32_t ttl_ms{ 0 };
     };
 
 public:
     inline static std::vector<Cmd> cmd_list;
+    inline static std::vector<std::function<void(QShell &)>> var_list;
     inline static QShell *cli{ nullptr };
     static int init(QShell &inst)
     {
@@ -34,27 +64,72 @@ public:
             return -1;
         }
         cli = &inst;
+
+        std::vector<QcliDesc> descs;
+        descs.reserve(cmd_list.size());
         for(auto &cmd : cmd_list) {
-            if(cmd.parent.empty()) {
-                inst.cmd_add(cmd.name.c_str(), cmd.cb, cmd.help.c_str());
+            if(cmd.cb != nullptr) {
+                descs.push_back({ cmd.parent.empty() ? nullptr : cmd.parent.c_str(), cmd.name.c_str(), cmd.cb,
+                        cmd.help.c_str() });
             }
         }
+        inst.cmd_add_many(descs.data(), descs.size());
 
         for(auto &cmd : cmd_list) {
-            if(!cmd.parent.empty()) {
-                inst.cmd_sub_add(cmd.parent.c_str(), cmd.name.c_str(), cmd.cb, cmd.help.c_str());
+            if(cmd.table != nullptr) {
+                inst.cmd_table_set(cmd.name.c_str(), cmd.table, cmd.table_size);
             }
+            if(cmd.ttl_ms != 0) {
+                std::string path = cmd.parent.empty() ? cmd.name : cmd.parent + " " + cmd.name;
+                inst.cmd_cache(path.c_str(), cmd.ttl_ms);
+            }
+        }
+#ifdef CMDMGR_USE_SECTION
+        load(inst, __start_qcli_cmd, __start_qcli_node, __stop_qcli_cmd - __start_qcli_cmd, __start_qcli_ext,
+            __stop_qcli_ext);
+        inst.var_add_many(__start_qcli_var, __stop_qcli_var - __start_qcli_var);
+#endif
+        for(auto &bind : var_list) {
+            bind(inst);
         }
 
         inited = true;
         return 0;
     }
 
+    // Registers n descriptors on the caller's nodes in one bulk pass, then binds tables and caches
+    static void load(QShell &inst, QcliDesc *descs, QcliCmd *cmds, size_t n, const CmdDesc *begin,
+        const CmdDesc *end)
+    {
+        inst.cmd_add_many(descs, cmds, n);
+
+        for(const CmdDesc *d = begin; d < end; d++) {
+            if(d->table != nullptr) {
+                inst.cmd_table_set(d->name, d->table, d->table_size);
+            }
+            if(d->ttl_ms != 0) {
+                std::string path = d->parent != nullptr ? std::string(d->parent) + " " + d->name : d->name;
+                inst.cmd_cache(path.c_str(), d->ttl_ms);
+            }
+        }
+    }
+
     CmdMgr(std::string name, Callback cb, std::string help) { cmd_list.push_back({ "", name, cb, help }); }
 
-    CmdMgr(std::string parent, std::string name, Callback cb, std::string help)
+    CmdMgr(std::string parent, std::string name, Callback cb, std::string help, uint32_t ttl_ms = 0)
+    {
+        cmd_list.push_back({ parent, name, cb, help, nullptr, 0, ttl_ms });
+    }
+
+    CmdMgr(std::string name, QcliTable *table, size_t table_size)
     {
-        cmd_list.push_back({ parent, name, cb, help });
+        cmd_list.push_back({ "", name, nullptr, "", table, table_size });
+    }
+
+    template<typename T>
+    CmdMgr(const char *name, std::atomic<T> &var, const char *desc)
+    {
+        var_list.push_back([name, &var, desc](QShell &inst) { inst.var_add(name, var, desc); });
     }
 };
 
@@ -64,12 +139,60 @@ using CmdTable = QShell::ArgsTable;
 #define DBG_PRINTLN(fmt, ...) CmdMgr::cli->println(fmt, ##__VA_ARGS__)
 #define DBG_PRINT(fmt, ...)   CmdMgr::cli->print(fmt, ##__VA_ARGS__)
 
+/* typed print, format checked at compile time: DBG_OUTLN("id {} val {:.3}", id, val) */
+#define DBG_OUT(fmt, ...)   CmdMgr::cli->tprint(fmt, ##__VA_ARGS__)
+#define DBG_OUTLN(fmt, ...) CmdMgr::cli->tprintln(fmt, ##__VA_ARGS__)
+
+#ifdef CMDMGR_USE_SECTION
+#define CMDMGR_SECTION_(sec, type) __attribute__((used, section(#sec), aligned(alignof(type))))
+
+/* register a new command */
+#define CMD_REGIST(name, cb, help)                                                                  \
+    static QcliDesc __cmd_##cb CMDMGR_SECTION_(qcli_cmd, QcliDesc) = { nullptr, name, cb, help }; \
+    static QcliCmd __node_##cb CMDMGR_SECTION_(qcli_node, QcliCmd)
+
+/* register a new sub command */
+#define CMD_SUB_REGIST(parent, name, cb, help)                                                     \
+    static QcliDesc __cmd_##cb CMDMGR_SECTION_(qcli_cmd, QcliDesc) = { parent, name, cb, help }; \
+    static QcliCmd __node_##cb CMDMGR_SECTION_(qcli_node, QcliCmd)
+
+/* register a command whose output and status are replayed for ttl_ms per argv */
+#define CMD_CACHED_REGIST(name, cb, help, ttl_ms) \
+    CMD_REGIST(name, cb, help);                   \
+    static const CmdDesc __ext_##cb CMDMGR_SECTION_(qcli_ext, CmdDesc) = { nullptr, name, nullptr, 0, ttl_ms }
+
+/* register a cached sub command */
+#define CMD_SUB_CACHED_REGIST(parent, name, cb, help, ttl_ms) \
+    CMD_SUB_REGIST(parent, name, cb, help);                   \
+    static const CmdDesc __ext_##cb CMDMGR_SECTION_(qcli_ext, CmdDesc) = { parent, name, nullptr, 0, ttl_ms }
+
+/* bind an argument table to a registered command, keys are dispatched by the core */
+#define CMD_TABLE_REGIST(name, table) \
+    static const CmdDesc __tab_##table CMDMGR_SECTION_(qcli_ext, CmdDesc) = { nullptr, name, table, sizeof(table), 0 }
+
+/* register a live variable for `var get/set/list/stream`, var is an std::atomic<T> */
+#define VAR_REGIST(name, var, desc) \
+    static const QShellVarDesc __var_##var CMDMGR_SECTION_(qcli_var, QShellVarDesc) = QShell::var_desc(name, var, desc)
+#else
 /* register a new command */
 #define CMD_REGIST(name, cb, help) static CmdMgr __cmd_##cb(name, cb, help)
 
 /* register a new sub command */
 #define CMD_SUB_REGIST(parent, name, cb, help) static CmdMgr __cmd_##cb(parent, name, cb, help)
 
+/* register a command whose output and status are replayed for ttl_ms per argv */
+#define CMD_CACHED_REGIST(name, cb, help, ttl_ms) static CmdMgr __cmd_##cb("", name, cb, help, ttl_ms)
+
+/* register a cached sub command */
+#define CMD_SUB_CACHED_REGIST(parent, name, cb, help, ttl_ms) static CmdMgr __cmd_##cb(parent, name, cb, help, ttl_ms)
+
+/* bind an argument table to a registered command, keys are dispatched by the core */
+#define CMD_TABLE_REGIST(name, table) static CmdMgr __tab_##table(name, table, sizeof(table))
+
+/* register a live variable for `var get/set/list/stream`, var is an std::atomic<T> */
+#define VAR_REGIST(name, var, desc) static CmdMgr __var_##var(name, var, desc)
+#endif
+
 /* trick to parse command line arguments */
 #define CMD_ARGS_TRICK(argc, argv, table)                                \
     if(CmdMgr::cli == nullptr) {                                         \
@@ -84,7 +207,13 @@ using CmdTable = QShell::ArgsTable;
 #define CmdTable              ((void)0)
 #define DBG_PRINTLN(fmt, ...) ((void)0)
 #define DBG_PRINT(fmt, ...)   ((void)0)
+#define DBG_OUT(fmt, ...)     ((void)0)
+#define DBG_OUTLN(fmt, ...)   ((void)0)
 #define CMD_REGIST(name, cb, help)
 #define CMD_SUB_REGIST(parent, name, cb, help)
+#define CMD_CACHED_REGIST(name, cb, help, ttl_ms)
+#define CMD_SUB_CACHED_REGIST(parent, name, cb, help, ttl_ms)
+#define CMD_TABLE_REGIST(name, table)
+#define VAR_REGIST(name, var, desc)
 #define CMD_ARGS_TRICK(argc, argv, table)
 #endif
@@ -11,9 +11,9 @@
 
 static int args_dump(int argc, char **argv)
 {
-    std::printf(" dump:\r\n");
+    DBG_PRINT(" dump:\r\n");
     for(int i = 0; i < argc; i++) {
-        std::printf(" argv[%d]: %s\r\n", i, argv[i]);
+        DBG_PRINT(" argv[%d]: %s\r\n", i, argv[i]);
     }
     return 0;
 }
@@ -26,18 +26,20 @@ static int cmd_demo(int argc, char **argv)
 {
     if(argc == 1) {
         for(int i = 0; i < argc; i++) {
-            std::printf(" argv[%d]: %s\r\n", i, argv[i]);
+            DBG_PRINT(" argv[%d]: %s\r\n", i, argv[i]);
         }
     }
-    CMD_ARGS_TRICK(argc, argv, table)
+    // keys of the bound table are dispatched by the core, anything else is unknown
+    return argc < 2 ? QCLI_ERR_PARAM : QCLI_ERR_PARAM_UNKNOWN;
 }
 CMD_REGIST("demo", cmd_demo, "demo command");
+CMD_TABLE_REGIST("demo", table);
 
 static int subcmd_demo_dump(int argc, char **argv)
 {
-    std::printf(" subcmd:\r\n");
+    DBG_PRINT(" subcmd:\r\n");
     for(int i = 0; i < argc; i++) {
-        std::printf(" argv[%d]: %s\r\n", i, argv[i]);
+        DBG_PRINT(" argv[%d]: %s\r\n", i, argv[i]);
     }
     return 0;
 }
@@ -19,7 +19,9 @@ int main()
     QShell cli(std::printf, nullptr);
 
     CmdMgr::init(cli);
-    cli.title();
+    if(!cli.piped()) {
+        cli.title();
+    }
     cli.exec();
 
     return 0;
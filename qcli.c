@@ -10,7 +10,9 @@
 #include <stdbool.h>
 #include "qcli.h"
 
+#if !QCLI_REDRAW_DIFF
 static const char *_CLEAR_LINE = "\r\x1b[K";
+#endif
 static const char *_PREFIX = "\\>$ ";
 static const char *_CLEAR_DISP = "\033[H\033[2J";
 
@@ -58,10 +60,52 @@ static const char *_CLEAR_DISP = "\033[H\033[2J";
 #define _QCLI_CSAP_BBAR "\033[5SPq"    // cursor shape blinking bar
 #define _QCLI_CSAP_SBAR "\033[6SPq"    // cursor shape steady bar
 
+#if defined(__GNUC__) || defined(__clang__)
+#define load_acquire_(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release_(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define fence_acquire_()     __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define fence_release_()     __atomic_thread_fence(__ATOMIC_RELEASE)
+#define swap_acquire_(p, v)  __atomic_exchange_n((p), (v), __ATOMIC_ACQUIRE)
+#define add_relaxed_(p, v)   __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#else
+// Single core targets: volatile accesses are not reordered by the compiler
+#define load_acquire_(p)     (*(p))
+#define store_release_(p, v) (*(p) = (v))
+#define fence_acquire_()     ((void)0)
+#define fence_release_()     ((void)0)
+#define swap_acquire_(p, v)  swap_plain_((p), (v))
+#define add_relaxed_(p, v)   (*(p) += (v))
+static inline uint32_t swap_plain_(uint32_t *p, uint32_t v)
+{
+    uint32_t old = *p;
+    *p = v;
+    return old;
+}
+#endif
+
+// Stage boundaries for the profiler hook, compiled out unless QCLI_PROF
+#if QCLI_PROF
+#define prof_(cli, stage, enter) ((cli)->prof ? (cli)->prof((cli), (stage), (enter)) : (void)0)
+#else
+#define prof_(cli, stage, enter) ((void)0)
+#endif
+
+// Core output goes through print_ so the bytes sent to the terminal can be accounted
+#if QCLI_PROF
+#define print_(cli, ...)                                                               \
+    (prof_((cli), QCLI_STAGE_OUTPUT, 1), tx_count_((cli), (cli)->print(__VA_ARGS__)), \
+     prof_((cli), QCLI_STAGE_OUTPUT, 0))
+#else
+#define print_(cli, ...) tx_count_((cli), (cli)->print(__VA_ARGS__))
+#endif
+
 #define QCLI_ENTRY(ptr, type, member) ((type *)((char *)(ptr) - (uintptr_t) & ((type *)0)->member))
-#define QCLI_ITERATOR(node, cmds)     for(node = (cmds)->next; node != (cmds); node = node->next)
-#define QCLI_ITERATOR_SAFE(node, cache, list) \
-    for(node = (list)->next, cache = node->next; node != (list); node = cache, cache = node->next)
+// Lists are walked with acquire loads, a writer on another thread publishes nodes with release stores
+#define QCLI_ITERATOR(node, cmds) \
+    for(node = load_acquire_(&(cmds)->next); node != (cmds); node = load_acquire_(&node->next))
+#define QCLI_ITERATOR_SAFE(node, cache, list)                                      \
+    for(node = load_acquire_(&(list)->next), cache = load_acquire_(&node->next); node != (list); \
+            node = cache, cache = load_acquire_(&node->next))
 
 #if QCLI_USE_STDLIBC_
 #include <string.h>
@@ -154,6 +198,40 @@ static int strncmp_(const char *s1, const char *s2, size_t n)
 }
 #endif
 
+static inline void tx_count_(Qcli *cli, int n)
+{
+    if(n > 0) {
+        add_relaxed_(&cli->tx_bytes, (size_t)n);
+    }
+}
+
+// Runs a command callback as its own profiler stage
+static inline int call_(Qcli *cli, QcmdCallback cb, int argc, char **argv)
+{
+#if QCLI_PROF
+    prof_(cli, QCLI_STAGE_CALLBACK, 1);
+    int ret = cb(argc, argv);
+    prof_(cli, QCLI_STAGE_CALLBACK, 0);
+    return ret;
+#else
+    UNUSED(cli);
+    return cb(argc, argv);
+#endif
+}
+
+static inline int node_call_(Qcli *cli, QcmdNodeCallback ncb, QcliCmd *cmd, int argc, char **argv)
+{
+#if QCLI_PROF
+    prof_(cli, QCLI_STAGE_CALLBACK, 1);
+    int ret = ncb(cmd, argc, argv);
+    prof_(cli, QCLI_STAGE_CALLBACK, 0);
+    return ret;
+#else
+    UNUSED(cli);
+    return ncb(cmd, argc, argv);
+#endif
+}
+
 static inline void rb_reset_(QcliRb *buf)
 {
     for(size_t i = 0; i < buf->capacity; i++) {
@@ -251,21 +329,168 @@ static void *strdelete_(char *s, size_t offset, size_t size)
     return s;
 }
 
+// The node is complete before it becomes reachable, so concurrent readers never see a partial node
 static inline void list_insert_(QcliList *list, QcliList *node)
 {
-    list->next->prev = node;
     node->next = list->next;
-
-    list->next = node;
     node->prev = list;
+
+    list->next->prev = node;
+    store_release_(&list->next, node);
 }
 
+// The removed node keeps its links, a reader standing on it still finds its way back to the list
 static inline void list_remove_(QcliList *node)
 {
     node->next->prev = node->prev;
-    node->prev->next = node->next;
+    store_release_(&node->prev->next, node->next);
+}
+
+static void swap_(uint8_t *a, uint8_t *b, size_t sz)
+{
+    while(sz--) {
+        uint8_t t = *a;
+        *a++ = *b;
+        *b++ = t;
+    }
+}
+
+static void sift_(uint8_t *base, size_t root, size_t n, size_t sz, int (*cmp)(const void *, const void *))
+{
+    for(;;) {
+        size_t child = 2 * root + 1;
+        if(child >= n) {
+            break;
+        }
+        if(child + 1 < n && cmp(base + child * sz, base + (child + 1) * sz) < 0) {
+            child++;
+        }
+        if(cmp(base + root * sz, base + child * sz) >= 0) {
+            break;
+        }
+        swap_(base + root * sz, base + child * sz, sz);
+        root = child;
+    }
+}
+
+// In place heap sort, O(n log n) without recursion or heap allocation
+static void sort_(void *base, size_t n, size_t sz, int (*cmp)(const void *, const void *))
+{
+    uint8_t *b = (uint8_t *)base;
+    if(n < 2) {
+        return;
+    }
+    for(size_t i = n / 2; i-- > 0;) {
+        sift_(b, i, n, sz, cmp);
+    }
+    for(size_t i = n - 1; i > 0; i--) {
+        swap_(b, b + i * sz, sz);
+        sift_(b, 0, i, sz, cmp);
+    }
+}
+
+static int table_cmp_(const void *a, const void *b)
+{
+    return strcmp_(((const QcliTable *)a)->name, ((const QcliTable *)b)->name);
+}
+
+// Index of the first table entry not less than key (first prefix match when n is the key length)
+static size_t table_lower_(const QcliCmd *cmd, const char *key, size_t n)
+{
+    size_t lo = 0;
+    size_t hi = cmd->table_n;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(strncmp_(cmd->table[mid].name, key, n) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// FNV-1a over the name, seeded with the parent so sibling tables share one index
+static size_t hash_(const QcliCmd *parent, const char *name)
+{
+    uint32_t h = 2166136261u ^ (uint32_t)((uintptr_t)parent >> 3);
+    while(*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Lookups may run on another thread than the writer. Chains are only re-linked by qcli_hash_set(), which
+// makes hseq odd meanwhile, a lookup that overlapped it is repeated.
+static QcliCmd *hash_find_(Qcli *cli, const QcliCmd *parent, const char *name)
+{
+    size_t h = hash_(parent, name);
+    for(;;) {
+        uint32_t seq = load_acquire_(&cli->hseq);
+        QcliCmd *found = NULL;
+        if((seq & 1) == 0) {
+            // hsize first: qcli_hash_set() orders its stores so that this size never exceeds the table read next
+            size_t hsize = load_acquire_(&cli->hsize);
+            QcliCmd **htab = load_acquire_(&cli->htab);
+            QcliCmd *cmd = load_acquire_(&htab[h & (hsize - 1)]);
+            for(; cmd; cmd = load_acquire_(&cmd->hnext)) {
+                if(cmd->parent == parent && strcmp_(cmd->name, name) == 0) {
+                    found = cmd;
+                    break;
+                }
+            }
+            fence_acquire_();
+            if(load_acquire_(&cli->hseq) == seq) {
+                return found;
+            }
+        }
+    }
+}
+
+// Invalidates everything derived from the command tree, 0 is kept for "never rendered"
+static inline void gen_bump_(Qcli *cli)
+{
+    uint32_t gen = cli->gen + 1;
+    store_release_(&cli->gen, gen ? gen : 1);
+}
+
+static void hash_insert_(Qcli *cli, QcliCmd *cmd)
+{
+    QcliCmd **bucket = &cli->htab[hash_(cmd->parent, cmd->name) & (cli->hsize - 1)];
+    cmd->hnext = *bucket;
+    store_release_(bucket, cmd);
+    cli->cmds_n++;
+    gen_bump_(cli);
+}
+
+static void hash_remove_(Qcli *cli, QcliCmd *cmd)
+{
+    QcliCmd **link = &cli->htab[hash_(cmd->parent, cmd->name) & (cli->hsize - 1)];
+    for(; *link; link = &(*link)->hnext) {
+        if(*link == cmd) {
+            store_release_(link, cmd->hnext);
+            cli->cmds_n--;
+            gen_bump_(cli);
+            return;
+        }
+    }
+}
 
-    node->next = node->prev = node;
+// (Un)index a command with all its subcommands, used when a tree is attached or detached
+static void hash_tree_(Qcli *cli, QcliCmd *cmd, bool insert)
+{
+    if(insert) {
+        hash_insert_(cli, cmd);
+    } else {
+        hash_remove_(cli, cmd);
+    }
+    cmd->cli = insert ? cli : NULL;
+    QcliList *node;
+    QCLI_ITERATOR(node, &cmd->sublevel)
+    {
+        hash_tree_(cli, QCLI_ENTRY(node, QcliCmd, node), insert);
+    }
 }
 
 static int cmd_exists_(Qcli *cli, QcliCmd *cmd)
@@ -273,15 +498,7 @@ static int cmd_exists_(Qcli *cli, QcliCmd *cmd)
     if(!cli || !cmd) {
         return -1;
     }
-    QcliList *_node;
-    QCLI_ITERATOR(_node, &cli->cmds)
-    {
-        QcliCmd *_cmd = QCLI_ENTRY(_node, QcliCmd, node);
-        if(strcmp_(_cmd->name, cmd->name) == 0) {
-            return 1;
-        }
-    }
-    return 0;
+    return hash_find_(cli, NULL, cmd->name) != NULL;
 }
 
 static inline void cli_reset_buffer_(Qcli *cli)
@@ -308,83 +525,136 @@ static QcliCmd *cmd_find_in_list_(QcliList *list, const char *name)
     return NULL;
 }
 
-static void tab_complete_(Qcli *cli)
+#if QCLI_REDRAW_DIFF
+// Bring the terminal line from `old` (cursor at old_cursor) to the current args, emitting only
+// the cursor moves and characters that differ: skip the common prefix, rewrite the tail and
+// erase what is left of a longer old line
+static void line_redraw_(Qcli *cli, const char *old, size_t old_size, size_t old_cursor)
 {
-    if(!cli || !cli->args_size)
-        return;
+    size_t same = 0;
+    while(same < old_size && same < cli->args_size && old[same] == cli->args[same]) {
+        same++;
+    }
 
-    // Simple parsing to find first command
-    char *cmd = cli->args;
-    char *pos = NULL;
-    for(size_t i = 0; i < cli->args_size; i++) {
-        if(cli->args[i] == _KEY_SPACE) {
-            pos = &cli->args[i];
-            break;
+    if(old_cursor > same) {
+        print_(cli, "\033[%uD", (unsigned)(old_cursor - same));
+    } else if(old_cursor < same) {
+        print_(cli, "\033[%uC", (unsigned)(same - old_cursor));
+    }
+    if(same < cli->args_size) {
+        print_(cli, "%s", cli->args + same);
+    }
+    if(old_size > cli->args_size) {
+        print_(cli, "\x1b[K");
+    }
+    if(cli->args_size > cli->cursor_idx) {
+        print_(cli, "\033[%uD", (unsigned)(cli->args_size - cli->cursor_idx));
+    }
+}
+#else
+// Full redraw of prompt and line
+static void line_redraw_(Qcli *cli, const char *old, size_t old_size, size_t old_cursor)
+{
+    UNUSED(old);
+    UNUSED(old_size);
+    UNUSED(old_cursor);
+    print_(cli, "%s%s%s", _CLEAR_LINE, _PREFIX, cli->args);
+}
+#endif
+
+// Count (and optionally print) completion candidates among subcommands and table keys of a command
+static int complete_scan_(Qcli *cli, QcliList *list, const QcliCmd *owner, const char *part, size_t part_len,
+        bool print, const char **last)
+{
+    int cnt = 0;
+    QcliList *node;
+    QCLI_ITERATOR(node, list)
+    {
+        QcliCmd *cmd = QCLI_ENTRY(node, QcliCmd, node);
+        if(strncmp_(part, cmd->name, part_len) == 0) {
+            cnt++;
+            *last = cmd->name;
+            if(print) {
+                print_(cli, "%s  ", cmd->name);
+            }
+        }
+    }
+    if(owner && owner->table) {
+        for(size_t i = table_lower_(owner, part, part_len); i < owner->table_n; i++) {
+            if(strncmp_(part, owner->table[i].name, part_len) != 0) {
+                break;
+            }
+            cnt++;
+            *last = owner->table[i].name;
+            if(print) {
+                print_(cli, "%s  ", owner->table[i].name);
+            }
         }
     }
+    return cnt;
+}
+
+static void tab_complete_(Qcli *cli)
+{
+    if(!cli || !cli->args_size)
+        return;
 
-    // Determine if we're completing a subcommand or regular command
+    // Walk the completed tokens down the command tree, the last token is the one being completed
     QcliList *list = &cli->cmds;
+    QcliCmd *owner = NULL;
+    char *end = cli->args + cli->args_size;
+    char *pos = cli->args;
     char *part = NULL;
     size_t part_len = 0;
 
-    if(pos != NULL) {
-        // Has space, try to find parent command and complete subcommand
+    for(;;) {
+        while(owner && pos < end && *pos == _KEY_SPACE) {
+            pos++;
+        }
+        char *token = pos;
+        while(pos < end && *pos != _KEY_SPACE) {
+            pos++;
+        }
+        if(pos >= end) {
+            part = token;
+            break;
+        }
+
         *pos = '\0';
-        QcliCmd *parent_cmd = qcli_find(cli, cmd);
+        QcliCmd *next = owner ? qcli_sub_find(owner, token) : qcli_find(cli, token);
         *pos = _KEY_SPACE;
 
-        if(parent_cmd && parent_cmd->hierarchy) {
-            list = &parent_cmd->sublevel;
-            part = pos + 1;
-            part_len = cli->args_size - (part - cli->args);
-        } else {
-            // No subcommands, don't autocomplete
+        // Unknown token or a table key, nothing left to complete
+        if(!next || !(load_acquire_(&next->hierarchy) || next->table)) {
             return;
         }
-    } else {
-        // No space, complete regular commands
-        part = cli->args;
-        part_len = cli->args_size;
+        owner = next;
+        list = &owner->sublevel;
     }
+    part_len = end - part;
 
-    int cnt = 0;
     const char *last = NULL;
-
-    QcliList *node;
-    QCLI_ITERATOR(node, list)
-    {
-        QcliCmd *cmd = QCLI_ENTRY(node, QcliCmd, node);
-        if(strncmp_(part, cmd->name, part_len) == 0) {
-            cnt++;
-            last = cmd->name;
-        }
-    }
+    int cnt = complete_scan_(cli, list, owner, part, part_len, false, &last);
 
     if(cnt == 1) {
+        char old[QCLI_CMD_STR_MAX + 1];
+        size_t old_size = cli->args_size;
+        size_t old_cursor = cli->cursor_idx;
+        memcpy_(old, cli->args, old_size);
+
         size_t pre_len = part - cli->args;
         memset_(cli->args + pre_len, 0, QCLI_CMD_STR_MAX - pre_len);
         strcpy_(cli->args + pre_len, last);
         cli->args_size = pre_len + strlen_(last);
         cli->cursor_idx = cli->args_size;
         if(cli->flags.is_disp) {
-            cli->print("\r%s%s", _PREFIX, cli->args);
+            line_redraw_(cli, old, old_size, old_cursor);
         }
     } else if(cnt > 1) {
         if(cli->flags.is_disp) {
-            cli->print("\r\n");
-        }
-        QCLI_ITERATOR(node, list)
-        {
-            QcliCmd *cmd = QCLI_ENTRY(node, QcliCmd, node);
-            if(strncmp_(part, cmd->name, part_len) == 0) {
-                if(cli->flags.is_disp) {
-                    cli->print("%s  ", cmd->name);
-                }
-            }
-        }
-        if(cli->flags.is_disp) {
-            cli->print("\r\n%s%s", _PREFIX, cli->args);
+            print_(cli, "\r\n");
+            complete_scan_(cli, list, owner, part, part_len, true, &last);
+            print_(cli, "\r\n%s%s", _PREFIX, cli->args);
         }
     }
 }
@@ -396,7 +666,7 @@ static int history_cb_(int argc, char **argv)
     }
     Qcli *cli = (Qcli *)argv[1];
     for(uint8_t i = 0; i < cli->history.count; i++) {
-        cli->print("%2d: %s\r\n", i + 1, rb_get_(&cli->history, i));
+        print_(cli, "%2d: %s\r\n", i + 1, rb_get_(&cli->history, i));
     }
 
     return 0;
@@ -413,7 +683,7 @@ static int disp_cb_(int argc, char **argv)
     } else if(strcmp_(argv[1], "off") == 0) {
         cli->flags.is_disp = 0;
     } else {
-        cli->print(" disp on/off\r\n");
+        print_(cli, " disp on/off\r\n");
     }
 
     return 0;
@@ -423,49 +693,144 @@ static int disp_cb_(int argc, char **argv)
 #define QCLI_USAGE_OFFSET   20 // Fixed column for Usage information
 #define QCLI_SUBCMD_INDENT  2  // Subcommand Usage indent relative to main command
 
-// Helper function to print desc text with proper line wrapping and alignment
-static inline void usage_print_(Qcli *cli, const char *desc, int indent_col)
+// Help output goes to a cache buffer or, a page at a time, to print
+typedef struct {
+    Qcli *cli;
+    char *buf;    // render target, NULL to print
+    size_t size;
+    size_t len;
+    bool full;
+    size_t page;  // 1-based page to print, 0: all
+    size_t line;  // current line, the first two are the header
+} HelpOut;
+
+static bool help_visible_(const HelpOut *o)
+{
+    return o->page == 0 || o->line < 2 || (o->line - 2) / QCLI_HELP_PAGE == o->page - 1;
+}
+
+static void help_put_(HelpOut *o, const char *s, size_t n)
+{
+    if(o->buf) {
+        if(o->len + n > o->size) {
+            o->full = true;
+        } else {
+            memcpy_(o->buf + o->len, s, n);
+            o->len += n;
+        }
+        return;
+    }
+    // Lines outside the page are counted but not printed
+    while(n > 0) {
+        size_t k = 0;
+        while(k < n && s[k++] != '\n') {
+        }
+        if(help_visible_(o)) {
+            print_(o->cli, "%.*s", (int)k, s);
+        }
+        if(s[k - 1] == '\n') {
+            o->line++;
+        }
+        s += k;
+        n -= k;
+    }
+}
+
+static inline void help_str_(HelpOut *o, const char *s)
+{
+    help_put_(o, s, strlen_(s));
+}
+
+static void help_pad_(HelpOut *o, int n)
+{
+    static const char spaces[] = "                                ";
+    while(n > 0) {
+        int k = n < (int)sizeof(spaces) - 1 ? n : (int)sizeof(spaces) - 1;
+        help_put_(o, spaces, k);
+        n -= k;
+    }
+}
+
+// Desc text wrapped at QCLI_USAGE_DISP_MAX, continuation lines start at indent_col
+static void usage_print_(HelpOut *o, const char *desc, int indent_col)
 {
     size_t remain_len = strlen_(desc);
     size_t offset = 0;
-    bool first_line = true;
 
+    if(remain_len == 0) {
+        help_put_(o, "\r\n", 2);
+    }
     while(remain_len > 0) {
         size_t print_len = (remain_len > QCLI_USAGE_DISP_MAX) ? QCLI_USAGE_DISP_MAX : remain_len;
-
-        if(first_line) {
-            cli->print("%-.*s\r\n", print_len, desc);
-            first_line = false;
-        } else {
-            cli->print("%*s%-.*s\r\n", indent_col, "", print_len, desc + offset);
+        if(offset > 0) {
+            help_pad_(o, indent_col);
         }
-
+        help_put_(o, desc + offset, print_len);
+        help_put_(o, "\r\n", 2);
         offset += print_len;
         remain_len -= print_len;
     }
 }
 
-static int help_cb_(int argc, char **argv)
+// Widest subcommand or table key below cmd, each level is indented by QCLI_SUBCMD_INDENT
+static void help_width_(const QcliCmd *cmd, int depth, int *max_sub)
 {
-    if(argc < 2) {
-        return QCLI_ERR_PARAM;
+    int indent = (depth - 1) * QCLI_SUBCMD_INDENT;
+    QcliList *node;
+    QCLI_ITERATOR(node, &cmd->sublevel)
+    {
+        QcliCmd *subcmd = QCLI_ENTRY(node, QcliCmd, node);
+        int sub_len = indent + strlen_(subcmd->name);
+        if(sub_len > *max_sub) {
+            *max_sub = sub_len;
+        }
+        help_width_(subcmd, depth + 1, max_sub);
+    }
+    for(size_t i = 0; i < cmd->table_n; i++) {
+        int arg_len = indent + strlen_(cmd->table[i].name);
+        if(arg_len > *max_sub) {
+            *max_sub = arg_len;
+        }
     }
+}
 
-    // cli pointer is always at the last argument position for built-in commands
-    Qcli *cli = (Qcli *)argv[argc - 1];
-    bool show_sub = false; // 0: don't show subcommands, 1: show subcommands
+static void help_entry_(HelpOut *o, int indent, char mark, const char *name, int width, int pad)
+{
+    int len = strlen_(name);
+    char head[2] = { mark, ' ' };
+    help_pad_(o, 2 + indent);
+    help_put_(o, head, 2);
+    help_put_(o, name, len);
+    help_pad_(o, (width > len ? width - len : 0) + pad);
+}
 
-    // Check for -a flag to show subcommands (must be exact: argc == 3 means "?" "-a" cli)
-    if(argc == 3 && strcmp_(argv[1], "-l") == 0) {
-        show_sub = true;
-    } else if(argc > 3) {
-        return QCLI_ERR_PARAM;
-    }
+// Subcommands are listed depth first with '-', argument table keys after them with '.'
+static void help_sub_(HelpOut *o, const QcliCmd *cmd, int depth, int max_sub)
+{
+    int indent = (depth - 1) * QCLI_SUBCMD_INDENT;
+    // Subcommands: "   " (3) + name (max_sub) + padding to reach column 22
+    int sub_header = 3 + max_sub;
+    int sub_offset = QCLI_USAGE_OFFSET + QCLI_SUBCMD_INDENT;
+    int sub_pad = (sub_offset > sub_header) ? (sub_offset - sub_header) : 1;
 
-    if(!cli->flags.is_disp) {
-        return 0;
+    QcliList *node;
+    QCLI_ITERATOR(node, &cmd->sublevel)
+    {
+        QcliCmd *subcmd = QCLI_ENTRY(node, QcliCmd, node);
+        help_entry_(o, indent, '-', subcmd->name, max_sub - indent, sub_pad);
+        usage_print_(o, subcmd->desc, sub_offset);
+        help_sub_(o, subcmd, depth + 1, max_sub);
+    }
+    for(size_t i = 0; i < cmd->table_n; i++) {
+        help_entry_(o, indent, '.', cmd->table[i].name, max_sub - indent, sub_pad);
+        usage_print_(o, cmd->table[i].desc, sub_offset);
     }
+}
 
+// Commands whose name starts with prefix (NULL: all), with their trees if show_sub
+static void help_render_(Qcli *cli, HelpOut *o, bool show_sub, const char *prefix)
+{
+    size_t prefix_len = prefix ? strlen_(prefix) : 0;
     QcliList *node;
 
     int max_cmd = 0;
@@ -473,63 +838,125 @@ static int help_cb_(int argc, char **argv)
     QCLI_ITERATOR(node, &cli->cmds)
     {
         QcliCmd *cmd = QCLI_ENTRY(node, QcliCmd, node);
+        if(prefix && strncmp_(cmd->name, prefix, prefix_len) != 0) {
+            continue;
+        }
         int len = strlen_(cmd->name);
         if(len > max_cmd) {
             max_cmd = len;
         }
-
-        if(cmd->hierarchy) {
-            QcliList *subnode;
-            QCLI_ITERATOR(subnode, &cmd->sublevel)
-            {
-                QcliCmd *subcmd = QCLI_ENTRY(subnode, QcliCmd, node);
-                int sub_len = strlen_(subcmd->name);
-                if(sub_len > max_sub) {
-                    max_sub = sub_len;
-                }
-            }
+        if(show_sub) {
+            help_width_(cmd, 1, &max_sub);
         }
     }
 
-    cli->print("  Commands%-*s   Usage \r\n", max_cmd, "");
-    cli->print(" ----------%-*s----------\r\n", max_cmd, "");
+    help_str_(o, "  Commands");
+    help_pad_(o, max_cmd);
+    help_str_(o, "   Usage \r\n ----------");
+    help_pad_(o, max_cmd);
+    help_str_(o, "----------\r\n");
+
+    // Calculate padding: " " (1) + marker (1) + name (max_cmd) + padding to reach column 20
+    int header_len = 2 + max_cmd;
+    int pad = (QCLI_USAGE_OFFSET > header_len) ? (QCLI_USAGE_OFFSET - header_len) : 1;
 
     QCLI_ITERATOR(node, &cli->cmds)
     {
         QcliCmd *cmd = QCLI_ENTRY(node, QcliCmd, node);
+        if(prefix && strncmp_(cmd->name, prefix, prefix_len) != 0) {
+            continue;
+        }
+
+        // Mark commands with subcommands with '>', or '*' when their tree is listed
+        bool nested = load_acquire_(&cmd->hierarchy) || cmd->table;
+        char head[2] = { ' ', nested ? (show_sub ? '*' : '>') : ' ' };
+        int len = strlen_(cmd->name);
+        help_put_(o, head, 2);
+        help_put_(o, cmd->name, len);
+        help_pad_(o, max_cmd - len + pad);
+        usage_print_(o, cmd->desc, QCLI_USAGE_OFFSET);
 
-        // Mark commands with subcommands with '>'
-        char marker = ' ';
         if(show_sub) {
-            marker = cmd->hierarchy ? '*' : ' ';
-        } else {
-            marker = cmd->hierarchy ? '>' : ' ';
+            help_sub_(o, cmd, 1, max_sub);
         }
+    }
+}
+
+static void help_footer_(HelpOut *o)
+{
+    if(o->page == 0) {
+        return;
+    }
+    size_t body = o->line > 2 ? o->line - 2 : 0;
+    size_t pages = (body + QCLI_HELP_PAGE - 1) / QCLI_HELP_PAGE;
+    print_(o->cli, " -- page %u/%u --\r\n", (unsigned)o->page, (unsigned)(pages ? pages : 1));
+}
 
-        // Calculate padding: " " (1) + marker (1) + name (max_cmd) + padding to reach column 20
-        int header_len = 2 + max_cmd;
-        int pad = (QCLI_USAGE_OFFSET > header_len) ? (QCLI_USAGE_OFFSET - header_len) : 1;
+static int help_cb_(int argc, char **argv)
+{
+    if(argc < 2) {
+        return QCLI_ERR_PARAM;
+    }
 
-        cli->print(" %c%-*s%*s", marker, max_cmd, cmd->name, pad, "");
-        usage_print_(cli, cmd->desc, QCLI_USAGE_OFFSET);
+    // cli pointer is always at the last argument position for built-in commands
+    Qcli *cli = (Qcli *)argv[argc - 1];
+    bool show_sub = false;
+    const char *prefix = NULL;
+    size_t page = 0;
+
+    // ? [-l] [-p <page>] [prefix]
+    for(int i = 1; i < argc - 1; i++) {
+        if(strcmp_(argv[i], "-l") == 0) {
+            show_sub = true;
+        } else if(strcmp_(argv[i], "-p") == 0 && i + 1 < argc - 1) {
+            const char *p = argv[++i];
+            page = 0;
+            for(; *p >= '0' && *p <= '9'; p++) {
+                page = page * 10 + (*p - '0');
+            }
+            if(*p != '\0' || page == 0) {
+                return QCLI_ERR_PARAM_TYPE;
+            }
+        } else if(!prefix && argv[i][0] != '-') {
+            prefix = argv[i];
+        } else {
+            return QCLI_ERR_PARAM;
+        }
+    }
 
-        // Display subcommands if -a flag is provided and they exist
-        if(show_sub && cmd->hierarchy) {
-            QcliList *subnode;
-            QCLI_ITERATOR(subnode, &cmd->sublevel)
-            {
-                QcliCmd *subcmd = QCLI_ENTRY(subnode, QcliCmd, node);
-                // Subcommands: "   " (3) + name (max_sub) + padding to reach column 22
-                int sub_header = 3 + max_sub;
-                int sub_offset = QCLI_USAGE_OFFSET + QCLI_SUBCMD_INDENT;
-                int sub_pad = (sub_offset > sub_header) ? (sub_offset - sub_header) : 1;
+    if(!cli->flags.is_disp) {
+        return 0;
+    }
 
-                cli->print("  - %-*s%*s", max_sub, subcmd->name, sub_pad, "");
-                usage_print_(cli, subcmd->desc, sub_offset);
+    HelpOut o = { cli, NULL, 0, 0, false, page, 0 };
+    QcliHelpCache *cache = &cli->help[show_sub ? 1 : 0];
+    // One thread at a time renders or prints the cache, a concurrent `?` renders its own output directly
+    if(!prefix && cache->buf && swap_acquire_(&cache->busy, 1) == 0) {
+        uint32_t gen = load_acquire_(&cli->gen);
+        if(cache->gen != gen) {
+            HelpOut r = { cli, cache->buf, cache->size, 0, false, 0, 0 };
+            help_render_(cli, &r, show_sub, NULL);
+            cache->len = r.len;
+            cache->full = r.full;
+            cache->gen = gen;
+        }
+        bool hit = !cache->full;
+        if(hit) {
+            if(page == 0) {
+                print_(cli, "%.*s", (int)cache->len, cache->buf);
+            } else {
+                help_put_(&o, cache->buf, cache->len);
+                help_footer_(&o);
             }
         }
+        store_release_(&cache->busy, 0);
+        if(hit) {
+            return QCLI_EOK;
+        }
     }
 
+    help_render_(cli, &o, show_sub, prefix);
+    help_footer_(&o);
     return QCLI_EOK;
 }
 
@@ -543,22 +970,40 @@ static int clear_cb_(int argc, char **argv)
         return 0;
     }
 
-    cli->print(_CLEAR_DISP);
+    print_(cli, _CLEAR_DISP);
 
     return 0;
 }
 
-static int parser_(Qcli *cli, char *str, uint16_t len)
+// Operator tokens point to these, so an argument with the same text is not an operator
+static const char seq_semi_[] = ";";
+static const char seq_and_[] = "&&";
+static const char seq_or_[] = "||";
+
+// Length of the sequence operator at str (";", "&&" or "||"), 0 if there is none
+static inline int seq_op_len_(const char *str, const char *end)
 {
-    if(!cli || !str || len >= QCLI_CMD_STR_MAX) {
-        return -1;
+    if(*str == ';') {
+        return 1;
+    }
+    if((*str == '&' || *str == '|') && str + 1 < end && str[1] == *str) {
+        return 2;
     }
+    return 0;
+}
 
-    cli->argc = 0;
+// Splits str in place at spaces, argv gets at most QCLI_CMD_ARGC_MAX tokens. Sequence operators are tokens of
+// their own even when not separated by spaces, they point to seq_semi_/seq_and_/seq_or_. Text in single quotes
+// keeps its spaces and operators as plain text, the quotes are removed by moving the rest of the token down.
+static int tokenize_(char *str, size_t len, char **argv, int *argc)
+{
+    *argc = 0;
     char *token = str;
+    char *out = str;
     char *end = str + len;
     char *word_start = NULL;
     int in_word = 0;
+    int quoted = 0;
 
     str[len] = '\0';
 
@@ -569,55 +1014,70 @@ static int parser_(Qcli *cli, char *str, uint16_t len)
     if(token >= end) {
         return -1;
     }
+    out = token;
 
     while(token < end) {
-        if(*token == _KEY_SPACE) {
+        int op = quoted ? 0 : seq_op_len_(token, end);
+        if(!quoted && (*token == _KEY_SPACE || op > 0)) {
+            const char *op_str = op == 1 ? seq_semi_ : (*token == '&' ? seq_and_ : seq_or_);
             if(in_word) {
-                *token = '\0';
-                cli->argv[cli->argc++] = word_start;
+                *out++ = '\0';
+                argv[(*argc)++] = word_start;
                 in_word = 0;
 
-                if(cli->argc >= QCLI_CMD_ARGC_MAX) {
+                if(*argc >= QCLI_CMD_ARGC_MAX) {
                     return -2;
                 }
             }
-        } else {
-            if(!in_word) {
-                word_start = token;
-                in_word = 1;
+            if(op > 0) {
+                if(*argc >= QCLI_CMD_ARGC_MAX) {
+                    return -2;
+                }
+                argv[(*argc)++] = (char *)op_str;
+                token += op;
+            } else {
+                token++;
             }
+            continue;
         }
-        token++;
+        if(!in_word) {
+            word_start = out;
+            in_word = 1;
+        }
+        if(*token == '\'') {
+            quoted = !quoted;
+            token++;
+            continue;
+        }
+        *out++ = *token++;
     }
 
-    if(in_word && word_start < end) {
-        if(cli->argc >= QCLI_CMD_ARGC_MAX) {
+    if(in_word) {
+        if(*argc >= QCLI_CMD_ARGC_MAX) {
             return -2;
         }
-        cli->argv[cli->argc++] = word_start;
+        *out = '\0';
+        argv[(*argc)++] = word_start;
     }
 
-    if(cli->argc == 0) {
+    if(*argc == 0) {
         return -1;
     }
 
     return 0;
 }
 
-static inline int is_builtin_cmd_(const char *name)
+static int parser_(Qcli *cli, char *str, uint16_t len)
 {
-    return (strcmp_(name, "?") == 0) || (strcmp_(name, "hs") == 0) || (strcmp_(name, "disp") == 0) ||
-           (strcmp_(name, "clear") == 0);
+    if(!cli || !str || len >= QCLI_CMD_STR_MAX) {
+        return -1;
+    }
+    return tokenize_(str, len, cli->argv, &cli->argc);
 }
 
-static inline void cmd_exec_(Qcli *cli, QcliCmd *cmd, int *result)
+static inline int is_builtin_cmd_(Qcli *cli, const QcliCmd *cmd)
 {
-    if(is_builtin_cmd_(cmd->name)) {
-        cli->argv[cli->argc++] = (char *)cli;
-        *result = cmd->cb(cli->argc, cli->argv);
-    } else {
-        *result = cmd->cb(cli->argc, cli->argv);
-    }
+    return cmd == &cli->_help || cmd == &cli->_history || cmd == &cli->_disp || cmd == &cli->_clear;
 }
 
 static inline void err_info_(Qcli *cli, int result)
@@ -625,58 +1085,140 @@ static inline void err_info_(Qcli *cli, int result)
     if(result == QCLI_EOK) {
         return;
     } else if(result == QCLI_ERR_PARAM_UNKNOWN) {
-        cli->print(" #! unknown parameter !\r\n");
+        print_(cli, " #! unknown parameter !\r\n");
     } else if(result == QCLI_ERR_PARAM) {
-        cli->print(" #! parameter error !\r\n");
+        print_(cli, " #! parameter error !\r\n");
     } else if(result == QCLI_ERR_PARAM_LESS) {
-        cli->print(" #! parameter less !\r\n");
+        print_(cli, " #! parameter less !\r\n");
     } else if(result == QCLI_ERR_PARAM_MORE) {
-        cli->print(" #! parameter more !\r\n");
+        print_(cli, " #! parameter more !\r\n");
     } else if(result == QCLI_ERR_PARAM_TYPE) {
-        cli->print(" #! parameter type error !\r\n");
+        print_(cli, " #! parameter type error !\r\n");
+    } else if(result == QCLI_ERR_NOT_FOUND) {
+        print_(cli, " #! command not found !\r\n");
+    } else if(result == QCLI_ERR_BUF) {
+        print_(cli, " #! output overflow !\r\n");
     } else {
-        cli->print(" #! unknown error !\r\n");
+        print_(cli, " #! unknown error !\r\n");
     }
 }
 
-static int cmd_cb_(Qcli *cli)
+static void table_help_(Qcli *cli, const QcliCmd *cmd)
 {
-    if(!cli) {
-        return -1;
+    int l = 0;
+    for(size_t i = 0; i < cmd->table_n; i++) {
+        int len = strlen_(cmd->table[i].name);
+        if(len > l) {
+            l = len;
+        }
     }
+    for(size_t i = 0; i < cmd->table_n; i++) {
+        print_(cli, " %-*s  %s\r\n", l, cmd->table[i].name, cmd->table[i].desc);
+    }
+}
 
-    QcliList *_node;
-    QcliCmd *_cmd;
-    int result = 0;
+static int dispatch_(Qcli *cli, int argc, char **argv)
+{
+    int depth = 0;
+    QcliCmd *cmd = qcli_resolve(cli, argc, argv, &depth);
+    if(!cmd) {
+        return QCLI_ERR_NOT_FOUND;
+    }
 
-    QCLI_ITERATOR(_node, &cli->cmds)
-    {
-        _cmd = QCLI_ENTRY(_node, QcliCmd, node);
-        if(strcmp_(cli->argv[0], _cmd->name) == 0) {
-            if(_cmd->hierarchy && cli->argc > 1) {
-                QcliCmd *subcmd = qcli_sub_find(_cmd, cli->argv[1]);
-                if(subcmd) {
-                    cmd_exec_(cli, subcmd, &result);
-                } else {
-                    cmd_exec_(cli, _cmd, &result);
-                }
-            } else {
-                cmd_exec_(cli, _cmd, &result);
+    // Argument table keys are dispatched directly, the key becomes argv[0] of the entry callback
+    if(cmd->table && argc > depth) {
+        const QcliTable *arg = qcli_table_find(cmd, argv[depth]);
+        if(arg) {
+            return call_(cli, arg->cb, argc - depth, argv + depth);
+        }
+        if(argc == depth + 1 && strcmp_(argv[depth], "?") == 0) {
+            if(cli->flags.is_disp) {
+                table_help_(cli, cmd);
             }
+            return QCLI_EOK;
+        }
+    }
 
-            if(!cli->flags.is_disp) {
-                return 0;
-            }
+    QcmdNodeCallback ncb = load_acquire_(&cmd->ncb);
+    if(ncb) {
+        return node_call_(cli, ncb, cmd, argc, argv);
+    }
+    // Built-in commands receive the cli pointer as last argument
+    if(is_builtin_cmd_(cli, cmd)) {
+        argv[argc++] = (char *)cli;
+    }
+    QcmdCallback cb = load_acquire_(&cmd->cb);
+    return call_(cli, cb, argc, argv);
+}
+
+int qcli_seq_op(const char *tok)
+{
+    return tok == seq_semi_ || tok == seq_and_ || tok == seq_or_;
+}
 
-            err_info_(cli, result);
-            return 0;
+// Number of tokens up to the next operator, operators inside { } groups belong to the command taking the group
+static int seg_len_(int argc, char **argv)
+{
+    int depth = 0;
+    int n = 0;
+    for(; n < argc; n++) {
+        const char *tok = argv[n];
+        if(tok[0] == '{' && tok[1] == '\0') {
+            depth++;
+        } else if(tok[0] == '}' && tok[1] == '\0' && depth > 0) {
+            depth--;
+        } else if(depth == 0 && qcli_seq_op(tok)) {
+            break;
         }
     }
+    return n;
+}
 
-    if(cli->flags.is_disp) {
-        cli->print(" #! command not found !\r\n");
+// Runs "a ; b && c || d" left to right. A segment after && runs only if the last status is QCLI_EOK, after ||
+// only if it is not, after ; always. Skipped segments keep the status. Results are reported when verbose.
+static int run_(Qcli *cli, int argc, char **argv, int verbose)
+{
+    // Operators must separate non-empty segments, a trailing ';' is allowed
+    for(int i = 0; i < argc;) {
+        int n = seg_len_(argc - i, argv + i);
+        if(n == 0 || (i + n == argc - 1 && argv[i + n] != seq_semi_)) {
+            if(verbose && cli->flags.is_disp) {
+                print_(cli, " #! parse error !\r\n");
+            }
+            return QCLI_ERR_PARAM;
+        }
+        i += n + 1;
+    }
+
+    int result = QCLI_EOK;
+    char op = ';';
+    for(int i = 0; i < argc;) {
+        int n = seg_len_(argc - i, argv + i);
+        if(op == ';' || (op == '&') == (result == QCLI_EOK)) {
+            // dispatch_() may store the cli pointer after the segment, over the operator token
+            char *next = argv[i + n];
+            prof_(cli, QCLI_STAGE_DISPATCH, 1);
+            result = dispatch_(cli, n, argv + i);
+            prof_(cli, QCLI_STAGE_DISPATCH, 0);
+            argv[i + n] = next;
+            if(verbose && cli->flags.is_disp) {
+                err_info_(cli, result);
+            }
+        }
+        if(i + n < argc) {
+            op = argv[i + n][0];
+        }
+        i += n + 1;
     }
-    return -1;
+    return result;
+}
+
+static int cmd_cb_(Qcli *cli)
+{
+    if(!cli) {
+        return -1;
+    }
+    return run_(cli, cli->argc, cli->argv, 1) == QCLI_ERR_NOT_FOUND ? -1 : 0;
 }
 
 int qcli_init(Qcli *cli, QcliPrint print)
@@ -685,11 +1227,23 @@ int qcli_init(Qcli *cli, QcliPrint print)
         return -1;
     }
     cli->cmds.next = cli->cmds.prev = &cli->cmds;
+    cli->htab = cli->hbuf;
+    cli->hsize = QCLI_HASH_SIZE;
+    cli->hseq = 0;
+    cli->cmds_n = 0;
+    memset_(cli->hbuf, 0, sizeof(cli->hbuf));
+    cli->gen = 1;
+    memset_(cli->help, 0, sizeof(cli->help));
     rb_init_(&cli->history, QCLI_HISTORY_MAX);
     cli->print = print;
     cli->flags.is_echo = 0;
     cli->flags.is_disp = 1;
     cli->argc = 0;
+    cli->tx_bytes = 0;
+    cli->ring = NULL;
+#if QCLI_PROF
+    cli->prof = NULL;
+#endif
     cli->args_size = 0;
     cli->cursor_idx = 0;
     cli->hist_idx = 0;
@@ -697,7 +1251,8 @@ int qcli_init(Qcli *cli, QcliPrint print)
     cli->hist_recall_times = 0;
     memset_(cli->args, 0, sizeof(cli->args));
     memset_(&cli->argv, 0, sizeof(cli->argv));
-    qcli_add(cli, &cli->_help, "?", help_cb_, "[-l]: list sub, help");
+    cli->_help.owner = cli->_clear.owner = cli->_history.owner = cli->_disp.owner = NULL;
+    qcli_add(cli, &cli->_help, "?", help_cb_, "[-l] [-p page] [prefix]: help, -l lists subcommands");
     qcli_add(cli, &cli->_clear, "clear", clear_cb_, "clear screen");
     qcli_add(cli, &cli->_history, "hs", history_cb_, "show history");
     qcli_add(cli, &cli->_disp, "disp", disp_cb_, "display off or on");
@@ -714,37 +1269,181 @@ int qcli_title(Qcli *cli)
     if(!cli) {
         return -1;
     }
-    cli->print(_CLEAR_DISP);
-    cli->print("  ___   _  _          _ _\r\n");
-    cli->print(" / _ \\ | || |__   ___| | |\r\n");
-    cli->print("| | | / __) '_ \\ / _ \\ | |\r\n");
-    cli->print("| |_| \\__ \\ | | |  __/ | |\r\n");
-    cli->print(" \\__\\_(   /_| |_|\\___|_|_|\r\n");
-    cli->print("       |_|   >$ by: luoqi\r\n");
-    cli->print(_PREFIX);
+    print_(cli, _CLEAR_DISP);
+    print_(cli, "  ___   _  _          _ _\r\n");
+    print_(cli, " / _ \\ | || |__   ___| | |\r\n");
+    print_(cli, "| | | / __) '_ \\ / _ \\ | |\r\n");
+    print_(cli, "| |_| \\__ \\ | | |  __/ | |\r\n");
+    print_(cli, " \\__\\_(   /_| |_|\\___|_|_|\r\n");
+    print_(cli, "       |_|   >$ by: luoqi\r\n");
+    print_(cli, _PREFIX);
     return 0;
 }
 
-int qcli_add(Qcli *cli, QcliCmd *cmd, const char *name, QcmdCallback cb, const char *desc)
+static int add_(Qcli *cli, QcliCmd *cmd, const char *name, QcmdCallback cb, QcmdNodeCallback ncb, const char *desc)
 {
-    if(!cli || !cmd || !cb) {
-        return -1;
-    }
     cmd->name = name;
     cmd->cb = cb;
+    cmd->ncb = ncb;
     cmd->desc = desc;
     cmd->parent = NULL;
     cmd->hierarchy = 0;
+    cmd->table = NULL;
+    cmd->table_n = 0;
     cmd->sublevel.next = cmd->sublevel.prev = &cmd->sublevel;
     if(!cmd_exists_(cli, cmd)) {
         list_insert_(&cli->cmds, &cmd->node);
-        cmd->cli = cli;
+        hash_tree_(cli, cmd, true);
         return 0;
     } else {
         return -1;
     }
 }
 
+int qcli_add(Qcli *cli, QcliCmd *cmd, const char *name, QcmdCallback cb, const char *desc)
+{
+    if(!cli || !cmd || !cb) {
+        return -1;
+    }
+    return add_(cli, cmd, name, cb, NULL, desc);
+}
+
+int qcli_node_add(Qcli *cli, QcliCmd *cmd, const char *name, QcmdNodeCallback ncb, const char *desc)
+{
+    if(!cli || !cmd || !ncb) {
+        return -1;
+    }
+    return add_(cli, cmd, name, NULL, ncb, desc);
+}
+
+static int desc_cmp_(const void *a, const void *b)
+{
+    const QcliDesc *x = (const QcliDesc *)a;
+    const QcliDesc *y = (const QcliDesc *)b;
+    if(x->parent != y->parent) {
+        if(!x->parent || !y->parent) {
+            return x->parent ? 1 : -1;
+        }
+        int r = strcmp_(x->parent, y->parent);
+        if(r != 0) {
+            return r;
+        }
+    }
+    return strcmp_(x->name, y->name);
+}
+
+static bool desc_same_(const QcliDesc *x, const QcliDesc *y)
+{
+    return desc_cmp_(x, y) == 0;
+}
+
+int qcli_add_bulk(Qcli *cli, QcliDesc *descs, QcliCmd *cmds, size_t n)
+{
+    if(!cli || (n && (!descs || !cmds))) {
+        return -1;
+    }
+    sort_(descs, n, sizeof(QcliDesc), desc_cmp_);
+
+    size_t top = 0;
+    for(size_t i = 0; i < n; i++) {
+        cmds[i].cli = NULL;
+        if(!descs[i].parent) {
+            top = i + 1;
+        }
+    }
+
+    // Walk each group backwards, head insertion then leaves the lists in ascending order
+    int added = 0;
+    for(size_t i = top; i-- > 0;) {
+        if(i > 0 && desc_same_(&descs[i], &descs[i - 1])) {
+            continue;
+        }
+        if(qcli_add(cli, &cmds[i], descs[i].name, descs[i].cb, descs[i].desc) == 0) {
+            added++;
+        }
+    }
+
+    // Parent groups go forward, a parent path always sorts before the paths below it
+    for(size_t i = top; i < n;) {
+        size_t j = i + 1;
+        while(j < n && strcmp_(descs[j].parent, descs[i].parent) == 0) {
+            j++;
+        }
+        QcliCmd *parent = qcli_path_find(cli, descs[i].parent);
+        for(size_t k = j; k-- > i;) {
+            if(k > i && desc_same_(&descs[k], &descs[k - 1])) {
+                continue;
+            }
+            if(parent && qcli_sub_add(parent, &cmds[k], descs[k].name, descs[k].cb, descs[k].desc) == 0) {
+                added++;
+            } else {
+                cmds[k].cli = NULL;
+            }
+        }
+        i = j;
+    }
+    return added;
+}
+
+int qcli_help_cache(Qcli *cli, int mode, char *buf, size_t size)
+{
+    if(!cli || mode < 0 || mode > 1) {
+        return -1;
+    }
+    QcliHelpCache *cache = &cli->help[mode];
+    cache->buf = size ? buf : NULL;
+    cache->size = size;
+    cache->len = 0;
+    cache->gen = 0;
+    cache->full = false;
+    cache->busy = 0;
+    return 0;
+}
+
+int qcli_hash_set(Qcli *cli, QcliCmd **buckets, size_t size)
+{
+    if(!cli) {
+        return -1;
+    }
+    if(!buckets) {
+        buckets = cli->hbuf;
+        size = QCLI_HASH_SIZE;
+    }
+    if(size == 0 || (size & (size - 1)) != 0) {
+        return -1;
+    }
+    if(buckets == cli->htab) {
+        return 0;
+    }
+
+    QcliCmd **old = cli->htab;
+    size_t old_size = cli->hsize;
+    memset_(buckets, 0, size * sizeof(QcliCmd *));
+
+    store_release_(&cli->hseq, cli->hseq + 1);
+    fence_release_();
+    // A shrinking index publishes its size first, a growing one its table, see hash_find_()
+    if(size < old_size) {
+        store_release_(&cli->hsize, size);
+    }
+    cli->cmds_n = 0;
+    for(size_t i = 0; i < old_size; i++) {
+        QcliCmd *cmd = old[i];
+        while(cmd) {
+            QcliCmd *next = cmd->hnext;
+            QcliCmd **bucket = &buckets[hash_(cmd->parent, cmd->name) & (size - 1)];
+            store_release_(&cmd->hnext, *bucket);
+            store_release_(bucket, cmd);
+            cli->cmds_n++;
+            cmd = next;
+        }
+    }
+    store_release_(&cli->htab, buckets);
+    store_release_(&cli->hsize, size);
+    store_release_(&cli->hseq, cli->hseq + 1);
+    return 0;
+}
+
 int qcli_del(Qcli *cli, const char *name)
 {
     QcliCmd *_cmd = qcli_find(cli, name);
@@ -752,7 +1451,7 @@ int qcli_del(Qcli *cli, const char *name)
         return -1;
     }
     list_remove_(&_cmd->node);
-    _cmd->cli = NULL;
+    hash_tree_(cli, _cmd, false);
     return 0;
 }
 
@@ -763,7 +1462,7 @@ int qcli_insert(Qcli *cli, QcliCmd *cmd)
     }
     if(cmd_exists_(cli, cmd) == 0) {
         list_insert_(&cli->cmds, &cmd->node);
-        cmd->cli = cli;
+        hash_tree_(cli, cmd, true);
         return 0;
     } else {
         return -1;
@@ -784,7 +1483,14 @@ static void history_nav_(Qcli *cli, int direction)
         } else {
             return;
         }
-    } else if(direction == QCLI_HS_RECALL_DIR_NEXT) {
+    }
+
+    char old[QCLI_CMD_STR_MAX + 1];
+    size_t old_size = cli->args_size;
+    size_t old_cursor = cli->cursor_idx;
+    memcpy_(old, cli->args, old_size);
+
+    if(direction == QCLI_HS_RECALL_DIR_NEXT) {
         if(cli->hist_recall_times > 1) {
             // Move to next history entry
             cli->hist_recall_idx = (cli->hist_recall_idx + 1) % cli->history.count;
@@ -793,7 +1499,7 @@ static void history_nav_(Qcli *cli, int direction)
             // Reset to empty buffer
             cli_reset_buffer_(cli);
             if(cli->flags.is_disp) {
-                cli->print("%s%s", _CLEAR_LINE, _PREFIX);
+                line_redraw_(cli, old, old_size, old_cursor);
             }
             return;
         }
@@ -812,7 +1518,7 @@ static void history_nav_(Qcli *cli, int direction)
         cli->args[cli->args_size] = '\0'; // Ensure null-termination
 
         if(cli->flags.is_disp) {
-            cli->print("%s%s%s", _CLEAR_LINE, _PREFIX, cli->args);
+            line_redraw_(cli, old, old_size, old_cursor);
         }
     }
 }
@@ -829,7 +1535,7 @@ static void special_key_(Qcli *cli, char c)
     case _KEY_RIGHT:
         if(cli->cursor_idx < cli->args_size) {
             if(cli->flags.is_disp) {
-                cli->print(_QCLI_CUF(1));
+                print_(cli, _QCLI_CUF(1));
             }
             cli->cursor_idx++;
         }
@@ -837,7 +1543,7 @@ static void special_key_(Qcli *cli, char c)
     case _KEY_LEFT:
         if(cli->cursor_idx > 0) {
             if(cli->flags.is_disp) {
-                cli->print(_QCLI_CUB(1));
+                print_(cli, _QCLI_CUB(1));
             }
             cli->cursor_idx--;
         }
@@ -892,14 +1598,14 @@ static int x_delete_(Qcli *cli)
             // Deleting at the end of the line
             cli->args[cli->cursor_idx] = '\0';
             if(cli->flags.is_disp) {
-                cli->print("\b \b");
+                print_(cli, "\b \b");
             }
         } else {
             // Deleting in the middle of the line
             strdelete_(cli->args, cli->cursor_idx, 1);
             if(cli->flags.is_disp) {
-                cli->print(_QCLI_CUB(1));
-                cli->print(_QCLI_DCH(1));
+                print_(cli, _QCLI_CUB(1));
+                print_(cli, _QCLI_DCH(1));
             }
         }
     }
@@ -910,13 +1616,13 @@ static int x_enter_(Qcli *cli)
 {
     if(cli->args_size == 0) {
         if(!cli->flags.is_echo && cli->flags.is_disp) {
-            cli->print("\r\n%s", _PREFIX);
+            print_(cli, "\r\n%s", _PREFIX);
         }
         return 0;
     }
 
     if(!cli->flags.is_echo && cli->flags.is_disp) {
-        cli->print("\r\n");
+        print_(cli, "\r\n");
     }
 
     if((strcmp_(cli->args, "hs") != 0) && !cli->flags.is_echo) {
@@ -930,10 +1636,13 @@ static int x_enter_(Qcli *cli)
         }
     }
 
-    if(parser_(cli, cli->args, cli->args_size) != 0) {
+    prof_(cli, QCLI_STAGE_PARSE, 1);
+    int parsed = parser_(cli, cli->args, cli->args_size);
+    prof_(cli, QCLI_STAGE_PARSE, 0);
+    if(parsed != 0) {
         cli_reset_buffer_(cli);
         if(cli->flags.is_disp) {
-            cli->print(" #! parse error !\r\n%s", _PREFIX);
+            print_(cli, " #! parse error !\r\n%s", _PREFIX);
         }
         return 0;
     }
@@ -941,7 +1650,7 @@ static int x_enter_(Qcli *cli)
     cli_reset_buffer_(cli);
 
     if(!cli->flags.is_echo && cli->flags.is_disp) {
-        cli->print("\r\n%s", _PREFIX);
+        print_(cli, "\r\n%s", _PREFIX);
     }
     return 0;
 }
@@ -967,11 +1676,11 @@ static int x_default_char_(Qcli *cli, char c)
         strinsert_(cli->args, cli->cursor_idx++, &c, 1);
         cli->args_size++;
         if(cli->flags.is_disp) {
-            cli->print(_QCLI_ICH(1));
+            print_(cli, _QCLI_ICH(1));
         }
     }
     if(cli->flags.is_disp) {
-        cli->print("%c", c);
+        print_(cli, "%c", c);
     }
     /* Ensure null-termination after append/insert to keep string APIs safe */
     if(cli->args_size < QCLI_CMD_STR_MAX + 1) {
@@ -980,12 +1689,8 @@ static int x_default_char_(Qcli *cli, char c)
     return 0;
 }
 
-int qcli_exec(Qcli *cli, char c)
+static int exec_(Qcli *cli, char c)
 {
-    if(!cli) {
-        return -1;
-    }
-
     if(x_special_keys_(cli, c) == 0) {
         return 0;
     }
@@ -1003,39 +1708,77 @@ int qcli_exec(Qcli *cli, char c)
     }
 }
 
-int qcli_xstr(Qcli *cli, char *str)
+int qcli_exec(Qcli *cli, char c)
 {
-    if(!cli || !str) {
+    if(!cli) {
         return -1;
     }
+    prof_(cli, QCLI_STAGE_DECODE, 1);
+    int ret = exec_(cli, c);
+    prof_(cli, QCLI_STAGE_DECODE, 0);
+    return ret;
+}
 
-    const uint16_t len = strlen_(str);
-    if(len >= QCLI_CMD_STR_MAX) {
-        return -1;
+int qcli_xstr(Qcli *cli, char *str)
+{
+    QcliHandle h;
+    int ret = qcli_compile(cli, &h, str);
+    if(ret != QCLI_EOK) {
+        return ret;
     }
+    return qcli_invoke(&h);
+}
 
-    // Copy string to args buffer and parse it
-    memcpy_(cli->args, str, len);
-    cli->args[len] = '\0';
-    cli->args_size = len;
-
-    if(parser_(cli, cli->args, len) != 0) {
-        return -1;
+QcliCmd *qcli_resolve(Qcli *cli, int argc, char **argv, int *depth)
+{
+    if(!cli || argc < 1 || !argv || !argv[0]) {
+        return NULL;
     }
-
-    // Find and execute the command
-    QcliList *node;
-    QcliList *node_safe;
-    QcliCmd *cmd;
-    QCLI_ITERATOR_SAFE(node, node_safe, &cli->cmds)
-    {
-        cmd = QCLI_ENTRY(node, QcliCmd, node);
-        if(strcmp_(cli->argv[0], cmd->name) == 0) {
-            return cmd->cb(cli->argc, cli->argv);
+    QcliCmd *cmd = hash_find_(cli, NULL, argv[0]);
+    int d = 1;
+    while(cmd && load_acquire_(&cmd->hierarchy) && d < argc) {
+        QcliCmd *sub = hash_find_(cli, cmd, argv[d]);
+        if(!sub) {
+            break;
         }
+        cmd = sub;
+        d++;
     }
+    if(depth) {
+        *depth = d;
+    }
+    return cmd;
+}
 
-    return -4;
+QcliCmd *qcli_path_find(Qcli *cli, const char *path)
+{
+    if(!cli || !path) {
+        return NULL;
+    }
+    char name[QCLI_CMD_STR_MAX + 1];
+    QcliCmd *cmd = NULL;
+    for(;;) {
+        while(*path == _KEY_SPACE) {
+            path++;
+        }
+        if(*path == '\0') {
+            return cmd;
+        }
+        size_t len = 0;
+        while(path[len] && path[len] != _KEY_SPACE) {
+            len++;
+        }
+        if(len > QCLI_CMD_STR_MAX) {
+            return NULL;
+        }
+        memcpy_(name, path, len);
+        name[len] = '\0';
+        cmd = hash_find_(cli, cmd, name);
+        if(!cmd) {
+            return NULL;
+        }
+        path += len;
+    }
 }
 
 QcliCmd *qcli_find(Qcli *cli, const char *name)
@@ -1043,7 +1786,7 @@ QcliCmd *qcli_find(Qcli *cli, const char *name)
     if(!cli || !name) {
         return NULL;
     }
-    return cmd_find_in_list_(&cli->cmds, name);
+    return hash_find_(cli, NULL, name);
 }
 
 int qcli_sub_add(QcliCmd *parent, QcliCmd *cmd, const char *name, QcmdCallback cb, const char *desc)
@@ -1053,18 +1796,25 @@ int qcli_sub_add(QcliCmd *parent, QcliCmd *cmd, const char *name, QcmdCallback c
     }
     cmd->name = name;
     cmd->cb = cb;
+    cmd->ncb = NULL;
     cmd->desc = desc;
     cmd->parent = parent;
     cmd->hierarchy = 0;
+    cmd->table = NULL;
+    cmd->table_n = 0;
     cmd->sublevel.next = cmd->sublevel.prev = &cmd->sublevel;
-    cmd->cli = parent->cli;
+    cmd->cli = NULL;
 
-    if(cmd_find_in_list_(&parent->sublevel, name)) {
+    if(qcli_sub_find(parent, name)) {
         return -1; // Subcommand already exists
     }
 
     list_insert_(&parent->sublevel, &cmd->node);
-    parent->hierarchy = 1;
+    store_release_(&parent->hierarchy, true);
+    // Subcommands of a detached parent are indexed when the parent is added
+    if(parent->cli) {
+        hash_tree_(parent->cli, cmd, true);
+    }
     return 0;
 }
 
@@ -1073,9 +1823,32 @@ QcliCmd *qcli_sub_find(QcliCmd *parent, const char *name)
     if(!parent || !name) {
         return NULL;
     }
+    if(parent->cli) {
+        return hash_find_(parent->cli, parent, name);
+    }
     return cmd_find_in_list_(&parent->sublevel, name);
 }
 
+int qcli_cb_set(QcliCmd *cmd, QcmdCallback cb)
+{
+    if(!cmd || !cb || !cmd->cli || is_builtin_cmd_(cmd->cli, cmd)) {
+        return QCLI_ERR_PARAM;
+    }
+    store_release_(&cmd->cb, cb);
+    gen_bump_(cmd->cli);
+    return QCLI_EOK;
+}
+
+int qcli_node_cb_set(QcliCmd *cmd, QcmdNodeCallback ncb)
+{
+    if(!cmd || !cmd->cli || is_builtin_cmd_(cmd->cli, cmd) || (!ncb && !cmd->cb)) {
+        return QCLI_ERR_PARAM;
+    }
+    store_release_(&cmd->ncb, ncb);
+    gen_bump_(cmd->cli);
+    return QCLI_EOK;
+}
+
 int qcli_args_trick(int argc, char **argv, const QcliTable *table, size_t table_size)
 {
     if(!table || argc < 2) {
@@ -1092,3 +1865,260 @@ int qcli_args_trick(int argc, char **argv, const QcliTable *table, size_t table_
     }
     return QCLI_ERR_PARAM_UNKNOWN;
 }
+
+int qcli_table_bind(QcliCmd *cmd, QcliTable *table, size_t table_size)
+{
+    if(!cmd) {
+        return -1;
+    }
+    size_t n = table ? table_size / sizeof(QcliTable) : 0;
+    sort_(table, n, sizeof(QcliTable), table_cmp_);
+    cmd->table = n ? table : NULL;
+    cmd->table_n = n;
+    if(cmd->cli) {
+        gen_bump_(cmd->cli);
+    }
+    return 0;
+}
+
+const QcliTable *qcli_table_find(const QcliCmd *cmd, const char *name)
+{
+    if(!cmd || !name || !cmd->table) {
+        return NULL;
+    }
+    size_t i = table_lower_(cmd, name, (size_t)-1);
+    if(i < cmd->table_n && strcmp_(cmd->table[i].name, name) == 0) {
+        return &cmd->table[i];
+    }
+    return NULL;
+}
+
+int qcli_tokenize(char *str, size_t len, char **argv, int *argc)
+{
+    if(!str || !argv || !argc) {
+        return QCLI_ERR_PARAM;
+    }
+    int ret = tokenize_(str, len, argv, argc);
+    if(ret != 0) {
+        return ret == -2 ? QCLI_ERR_PARAM_MORE : QCLI_ERR_PARAM;
+    }
+    return QCLI_EOK;
+}
+
+int qcli_dispatch(Qcli *cli, int argc, char **argv)
+{
+    if(!cli || !argv || argc < 1 || argc > QCLI_CMD_ARGC_MAX) {
+        return QCLI_ERR_PARAM;
+    }
+    return run_(cli, argc, argv, 0);
+}
+
+// Does the lookups of dispatch_() once and records which callback gets which arguments
+static int handle_bind_(QcliHandle *h)
+{
+    Qcli *cli = h->cli;
+    int depth = 0;
+    int n = seg_len_(h->argc, h->argv);
+    h->gen = load_acquire_(&cli->gen);
+    h->cmd = qcli_resolve(cli, n, h->argv, &depth);
+    h->cb = NULL;
+    h->ncb = NULL;
+    if(n < h->argc) {
+        return QCLI_EOK; // a sequence, left to run_() even if its first command is unknown
+    }
+    if(!h->cmd) {
+        return QCLI_ERR_NOT_FOUND;
+    }
+    h->cb = load_acquire_(&h->cmd->cb);
+    h->ncb = load_acquire_(&h->cmd->ncb);
+    h->cb_argc = h->argc;
+    h->cb_argv = h->argv;
+
+    if(h->cmd->table && h->argc > depth) {
+        const QcliTable *arg = qcli_table_find(h->cmd, h->argv[depth]);
+        if(arg) {
+            h->cb = arg->cb;
+            h->ncb = NULL;
+            h->cb_argc = h->argc - depth;
+            h->cb_argv = h->argv + depth;
+        } else if(h->argc == depth + 1 && strcmp_(h->argv[depth], "?") == 0) {
+            h->cb = NULL; // table listing, left to dispatch_()
+            h->ncb = NULL;
+        }
+    } else if(is_builtin_cmd_(cli, h->cmd)) {
+        h->argv[h->argc] = (char *)cli;
+        h->cb_argc = h->argc + 1;
+    }
+    return QCLI_EOK;
+}
+
+int qcli_compile(Qcli *cli, QcliHandle *h, const char *str)
+{
+    if(!cli || !h || !str) {
+        return QCLI_ERR_PARAM;
+    }
+    size_t len = strlen_(str);
+    if(len >= QCLI_CMD_STR_MAX) {
+        return QCLI_ERR_PARAM_MORE;
+    }
+    memcpy_(h->buf, str, len);
+    h->cli = cli;
+    h->cmd = NULL;
+    h->cb = NULL;
+    prof_(cli, QCLI_STAGE_PARSE, 1);
+    int ret = tokenize_(h->buf, len, h->argv, &h->argc);
+    prof_(cli, QCLI_STAGE_PARSE, 0);
+    if(ret != 0) {
+        h->cli = NULL;
+        return ret == -2 ? QCLI_ERR_PARAM_MORE : QCLI_ERR_PARAM;
+    }
+    prof_(cli, QCLI_STAGE_DISPATCH, 1);
+    ret = handle_bind_(h);
+    prof_(cli, QCLI_STAGE_DISPATCH, 0);
+    return ret;
+}
+
+int qcli_compile_argv(Qcli *cli, QcliHandle *h, int argc, char **argv)
+{
+    if(!cli || !h || !argv || argc < 1 || argc > QCLI_CMD_ARGC_MAX) {
+        return QCLI_ERR_PARAM;
+    }
+    memcpy_(h->argv, argv, argc * sizeof(char *));
+    h->argc = argc;
+    h->cli = cli;
+    h->cmd = NULL;
+    h->cb = NULL;
+    prof_(cli, QCLI_STAGE_DISPATCH, 1);
+    int ret = handle_bind_(h);
+    prof_(cli, QCLI_STAGE_DISPATCH, 0);
+    return ret;
+}
+
+int qcli_invoke(QcliHandle *h)
+{
+    if(!h || !h->cli) {
+        return QCLI_ERR_PARAM;
+    }
+    if(h->gen != load_acquire_(&h->cli->gen)) {
+        prof_(h->cli, QCLI_STAGE_DISPATCH, 1);
+        handle_bind_(h);
+        prof_(h->cli, QCLI_STAGE_DISPATCH, 0);
+    }
+    if(h->ncb) {
+        return node_call_(h->cli, h->ncb, h->cmd, h->cb_argc, h->cb_argv);
+    }
+    if(!h->cb) {
+        return run_(h->cli, h->argc, h->argv, 0);
+    }
+    return call_(h->cli, h->cb, h->cb_argc, h->cb_argv);
+}
+
+int qcli_invoke_argv(const QcliHandle *h, int argc, char **argv)
+{
+    if(!h || !h->cli || !argv || argc < 1 || argc > QCLI_CMD_ARGC_MAX) {
+        return QCLI_ERR_PARAM;
+    }
+    Qcli *cli = h->cli;
+    if((!h->cb && !h->ncb) || h->gen != load_acquire_(&cli->gen)) {
+        return run_(cli, argc, argv, 0);
+    }
+    if(h->ncb) {
+        return node_call_(cli, h->ncb, h->cmd, argc, argv);
+    }
+    // Same split as the handle: a table entry gets the tokens from its key, a built-in the cli pointer
+    int skip = (int)(h->cb_argv - h->argv);
+    if(h->cb_argc > h->argc) {
+        argv[argc++] = (char *)cli;
+    }
+    return call_(cli, h->cb, argc - skip, argv + skip);
+}
+
+#if QCLI_PROF
+int qcli_prof_hook(Qcli *cli, QcliProfHook hook)
+{
+    if(!cli) {
+        return QCLI_ERR_PARAM;
+    }
+    cli->prof = hook;
+    return QCLI_EOK;
+}
+#endif
+
+int qcli_ring_init(QcliRing *ring, uint8_t *buf, size_t size)
+{
+    if(!ring || !buf || size < 2 || (size & (size - 1)) != 0) {
+        return -1;
+    }
+    ring->buf = buf;
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->overruns = 0;
+    ring->high_water = 0;
+    return 0;
+}
+
+int qcli_ring_push(QcliRing *ring, uint8_t c)
+{
+    size_t head = ring->head;
+    if(head - load_acquire_(&ring->tail) > ring->mask) {
+        ring->overruns++;
+        return -1;
+    }
+    ring->buf[head & ring->mask] = c;
+    store_release_(&ring->head, head + 1);
+    return 0;
+}
+
+int qcli_ring_pop(QcliRing *ring, uint8_t *c)
+{
+    size_t tail = ring->tail;
+    size_t used = load_acquire_(&ring->head) - tail;
+    if(used == 0) {
+        return -1;
+    }
+    if(used > ring->high_water) {
+        ring->high_water = used;
+    }
+    *c = ring->buf[tail & ring->mask];
+    store_release_(&ring->tail, tail + 1);
+    return 0;
+}
+
+int qcli_ring_attach(Qcli *cli, QcliRing *ring)
+{
+    if(!cli) {
+        return -1;
+    }
+    cli->ring = ring;
+    return 0;
+}
+
+int qcli_poll(Qcli *cli, size_t budget)
+{
+    if(!cli || !cli->ring) {
+        return -1;
+    }
+    int n = 0;
+    uint8_t c;
+    while((budget == 0 || (size_t)n < budget) && qcli_ring_pop(cli->ring, &c) == 0) {
+        qcli_exec(cli, (char)c);
+        n++;
+    }
+    return n;
+}
+
+int qcli_poll_for(Qcli *cli, QcliTick tick, uint32_t ticks)
+{
+    if(!cli || !cli->ring || !tick) {
+        return -1;
+    }
+    int n = 0;
+    uint8_t c;
+    uint32_t start = tick();
+    while((uint32_t)(tick() - start) < ticks && qcli_ring_pop(cli->ring, &c) == 0) {
+        qcli_exec(cli, (char)c);
+        n++;
+    }
+    return n;
+}
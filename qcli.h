@@ -64,6 +64,32 @@ extern "C" {
 #define QCLI_CMD_ARGC_MAX 10
 #endif
 
+/**
+ * @def QCLI_HASH_SIZE
+ * @brief Number of buckets of the built-in command index, must be a power of two.
+ * A larger index can be supplied at runtime with qcli_hash_set().
+ */
+#ifndef QCLI_HASH_SIZE
+#define QCLI_HASH_SIZE 32
+#endif
+
+/**
+ * @def QCLI_REDRAW_DIFF
+ * @brief Redraw recalled or completed lines by emitting only the differing characters.
+ * Set to 0 to reprint prompt and line instead.
+ */
+#ifndef QCLI_REDRAW_DIFF
+#define QCLI_REDRAW_DIFF 1
+#endif
+
+/**
+ * @def QCLI_HELP_PAGE
+ * @brief Lines per page of `? -p <n>`.
+ */
+#ifndef QCLI_HELP_PAGE
+#define QCLI_HELP_PAGE 20
+#endif
+
 /**
  * @def QCLI_SHOW_TITLE
  * @brief Enable or disable showing the title on initialization.
@@ -72,6 +98,15 @@ extern "C" {
 #define QCLI_SHOW_TITLE 0
 #endif
 
+/**
+ * @def QCLI_PROF
+ * @brief Report the stages of input handling to a profiler hook, see qcli_prof_hook().
+ * Set to 0 to compile the hook points out.
+ */
+#ifndef QCLI_PROF
+#define QCLI_PROF 0
+#endif
+
 /**
  * @brief Doubly linked list structure for command management.
  */
@@ -85,6 +120,8 @@ struct QcliList {
  * @brief Error codes for CLI operations.
  */
 typedef enum {
+    QCLI_ERR_BUF = -7,           /**< Output did not fit and was cut. */
+    QCLI_ERR_NOT_FOUND = -6,     /**< Command not found. */
     QCLI_ERR_PARAM_UNKNOWN = -5, /**< Unknown parameter. */
     QCLI_ERR_PARAM_TYPE = -4,    /**< Parameter type error. */
     QCLI_ERR_PARAM_MORE = -3,    /**< Too many parameters. */
@@ -108,11 +145,30 @@ typedef int (*QcmdCallback)(int, char **);
  */
 typedef int (*QcliPrint)(const char *fmt, ...);
 
+/**
+ * @brief Structure for argument table.
+ */
+typedef struct {
+    const char *name; /**< Argument name. */
+    QcmdCallback cb;  /**< Callback function. */
+    const char *desc; /**< Usage description. */
+} QcliTable;
+
 typedef struct Qcli Qcli; /**< Forward declaration for CLI object. */
 /**
  * @brief Structure representing a CLI command.
  */
 typedef struct QcliCmd QcliCmd; /**< Forward declaration for command. */
+
+/**
+ * @brief Callback that gets its command node, for commands sharing one function, see qcli_node_cb_set().
+ * @param cmd Command node.
+ * @param argc Number of arguments.
+ * @param argv Array of argument strings.
+ * @return Error code.
+ */
+typedef int (*QcmdNodeCallback)(QcliCmd *cmd, int argc, char **argv);
+
 struct QcliCmd {
     Qcli *cli;           /**< Pointer to the associated CLI object. */
     const char *name;       /**< Command name. */
@@ -122,8 +178,23 @@ struct QcliCmd {
     QcliList node;          /**< Linked list node. */
     QcliList sublevel;      /**< Linked list of subcommands. */
     bool hierarchy;         /**< Flag indicating if this command has subcommands. */
+    QcliTable *table;       /**< Argument table sorted by name, NULL if none. */
+    size_t table_n;         /**< Number of argument table entries. */
+    struct QcliCmd *hnext;  /**< Next command in the same index bucket. */
+    void *owner;            /**< Allocator of the node, not used by the core, NULL for the built-in commands. */
+    QcmdNodeCallback ncb;   /**< Runs instead of cb when set, see qcli_node_add() and qcli_node_cb_set(). */
 };
 
+/**
+ * @brief Command descriptor for bulk registration.
+ */
+typedef struct {
+    const char *parent; /**< Parent command name, NULL for a top-level command. */
+    const char *name;   /**< Command name. */
+    QcmdCallback cb;    /**< Callback function. */
+    const char *desc;   /**< Usage description. */
+} QcliDesc;
+
 /**
  * @brief Ring buffer structure for command history.
  */
@@ -135,6 +206,72 @@ typedef struct {
     size_t capacity;                                      /**< Capacity of the ring buffer. */
 } QcliRb;
 
+/**
+ * @brief Single-producer/single-consumer input byte ring.
+ *
+ * The producer (typically a UART ISR) only writes `head` and `overruns`, the consumer
+ * (qcli_poll() in the main loop) only writes `tail` and `high_water`, so no lock is needed.
+ */
+typedef struct {
+    uint8_t *buf;               /**< Storage, size is a power of two. */
+    size_t mask;                /**< Size minus one. */
+    volatile size_t head;       /**< Write position, advanced by the producer. */
+    volatile size_t tail;       /**< Read position, advanced by the consumer. */
+    volatile uint32_t overruns; /**< Bytes dropped because the ring was full. */
+    size_t high_water;          /**< Highest fill level seen by the consumer. */
+} QcliRing;
+
+/**
+ * @brief Tick source for time budgets, any monotonic unit.
+ */
+typedef uint32_t (*QcliTick)(void);
+
+/**
+ * @brief Stages of input handling reported to the profiler hook. Stages nest, e.g. output inside a callback.
+ */
+typedef enum {
+    QCLI_STAGE_READ,     /**< Reading input, reported by the caller of qcli_exec(). */
+    QCLI_STAGE_DECODE,   /**< Key decoding and line editing in qcli_exec(). */
+    QCLI_STAGE_PARSE,    /**< Tokenizing a line. */
+    QCLI_STAGE_DISPATCH, /**< Command lookup. */
+    QCLI_STAGE_CALLBACK, /**< Command callbacks. */
+    QCLI_STAGE_OUTPUT,   /**< Output written through print. */
+    QCLI_STAGE_NUM,      /**< Number of stages. */
+} QcliStage;
+
+/**
+ * @brief Profiler hook, called with `enter` 1 when a stage starts and 0 when it ends.
+ */
+typedef void (*QcliProfHook)(Qcli *cli, QcliStage stage, int enter);
+
+/**
+ * @brief Precompiled command line, see qcli_compile().
+ */
+typedef struct {
+    Qcli *cli;                        /**< CLI the command was resolved in. */
+    QcliCmd *cmd;                     /**< Resolved command or subcommand, NULL if not found. */
+    QcmdCallback cb;                  /**< Callback to run, the command's or its argument table entry's. */
+    QcmdNodeCallback ncb;             /**< Node callback of cmd, runs instead of cb when set. */
+    int cb_argc;                      /**< Arguments passed to cb. */
+    char **cb_argv;                   /**< Argument array passed to cb, points into argv. */
+    uint32_t gen;                     /**< Command generation of the resolution. */
+    int argc;                         /**< Number of tokens. */
+    char *argv[QCLI_CMD_ARGC_MAX + 1]; /**< Tokens, with room for the cli pointer of built-ins. */
+    char buf[QCLI_CMD_STR_MAX + 1];   /**< Token storage. */
+} QcliHandle;
+
+/**
+ * @brief Rendered help text of one mode, reused until the command tree changes.
+ */
+typedef struct {
+    char *buf;     /**< Text buffer, NULL if not cached. */
+    size_t size;   /**< Buffer size. */
+    size_t len;    /**< Length of the rendered text. */
+    uint32_t gen;  /**< Command generation the text was rendered at, 0 if not rendered. */
+    bool full;     /**< The text did not fit, help of this generation is printed directly. */
+    uint32_t busy; /**< Set while a thread renders or prints the text, others print directly. */
+} QcliHelpCache;
+
 /**
  * @brief Structure representing the CLI object.
  */
@@ -158,6 +295,11 @@ struct Qcli {
     uint8_t special_key;       /**< State for special key handling. */
     int argc;                  /**< Number of parsed arguments. */
     QcliPrint print;           /**< Print function. */
+    size_t tx_bytes;           /**< Bytes written by the core, as reported by print, updated atomically. */
+    QcliRing *ring;            /**< Input ring drained by qcli_poll(), NULL if not used. */
+#if QCLI_PROF
+    QcliProfHook prof; /**< Profiler hook, NULL if not profiling. */
+#endif
 
     QcliCmd _disp;    /**< Built-in display command. */
     QcliCmd _history; /**< Built-in history command. */
@@ -165,16 +307,16 @@ struct Qcli {
     QcliCmd _clear;   /**< Built-in clear command. */
 
     QcliList cmds; /**< List of registered commands. */
-};
 
-/**
- * @brief Structure for argument table.
- */
-typedef struct {
-    const char *name; /**< Argument name. */
-    QcmdCallback cb;  /**< Callback function. */
-    const char *desc; /**< Usage description. */
-} QcliTable;
+    QcliCmd **htab;                  /**< Command index buckets, keyed by parent and name. */
+    size_t hsize;                    /**< Number of index buckets (power of two). */
+    size_t cmds_n;                   /**< Number of indexed commands, subcommands included. */
+    uint32_t hseq;                   /**< Odd while qcli_hash_set() re-links the index. */
+    QcliCmd *hbuf[QCLI_HASH_SIZE];   /**< Built-in index buckets. */
+
+    uint32_t gen;          /**< Bumped whenever a command or table is added or removed. */
+    QcliHelpCache help[2]; /**< Cached output of `?` and `? -l`. */
+};
 
 /**
  * @brief Execute arguments from a table.
@@ -186,6 +328,28 @@ typedef struct {
  */
 int qcli_args_trick(int argc, char **argv, const QcliTable *table, size_t table_size);
 
+/**
+ * @brief Bind an argument table to a command.
+ *
+ * The table is sorted by name in place, so it must stay writable and alive while bound.
+ * When `argv` after the command matches a key, the entry callback is called with the
+ * key as `argv[0]`; keys are also offered by tab completion and listed by `? -l`.
+ *
+ * @param cmd Command to bind to.
+ * @param table Argument table, NULL to unbind.
+ * @param table_size Size of the table in bytes.
+ * @return Error code.
+ */
+int qcli_table_bind(QcliCmd *cmd, QcliTable *table, size_t table_size);
+
+/**
+ * @brief Find an argument table entry of a command.
+ * @param cmd Command with a bound table.
+ * @param name Argument name.
+ * @return Pointer to entry or NULL.
+ */
+const QcliTable *qcli_table_find(const QcliCmd *cmd, const char *name);
+
 /**
  * @brief Initialize the CLI object.
  * @param cli Pointer to CLI object.
@@ -212,8 +376,62 @@ int qcli_title(Qcli *cli);
  */
 int qcli_add(Qcli *cli, QcliCmd *cmd, const char *name, QcmdCallback cb, const char *desc);
 
+/**
+ * @brief Add a command whose callback gets its node, e.g. for commands defined at runtime that share one function
+ * and find their data through the node.
+ * @param cli Pointer to CLI object.
+ * @param cmd Pointer to command structure.
+ * @param name Command name.
+ * @param ncb Node callback.
+ * @param desc Usage string.
+ * @return Error code.
+ */
+int qcli_node_add(Qcli *cli, QcliCmd *cmd, const char *name, QcmdNodeCallback ncb, const char *desc);
+
+/**
+ * @brief Add many commands and subcommands at once.
+ *
+ * Descriptors are sorted in place by parent and name, duplicates are dropped in the same
+ * pass and each parent is resolved once per group, so loading n commands costs O(n log n).
+ * Parents are command paths such as "net if", either registered or part of the batch.
+ *
+ * @param cli Pointer to CLI object.
+ * @param descs Array of descriptors, reordered by the call.
+ * @param cmds Array of n command nodes, cmds[i] is used for descs[i] after sorting.
+ *             Nodes left unused have their `cli` member set to NULL.
+ * @param n Number of descriptors.
+ * @return Number of commands added or -1 on error.
+ */
+int qcli_add_bulk(Qcli *cli, QcliDesc *descs, QcliCmd *cmds, size_t n);
+
+/**
+ * @brief Replace the command index buckets, re-indexing all commands.
+ * Lookups running concurrently on other threads retry until the index is stable, the old bucket array
+ * must be kept until they are done.
+ * @param cli Pointer to CLI object.
+ * @param buckets Bucket array of `size` entries, NULL to use the built-in buckets.
+ * @param size Number of buckets, must be a power of two.
+ * @return Error code.
+ */
+int qcli_hash_set(Qcli *cli, QcliCmd **buckets, size_t size);
+
+/**
+ * @brief Cache the rendered help text in a caller supplied buffer.
+ * The text is rendered by the first `?` and kept until a command or argument table is added or removed,
+ * paging is served from the cache. Prefix filtered help is not cached.
+ * @param cli Pointer to CLI object.
+ * @param mode 0 for `?`, 1 for `? -l`.
+ * @param buf Text buffer, NULL to disable the cache of this mode.
+ * @param size Buffer size, help that does not fit is printed directly.
+ * @return Error code.
+ */
+int qcli_help_cache(Qcli *cli, int mode, char *buf, size_t size);
+
 /**
  * @brief Delete a command from the CLI.
+ * Commands can be added and deleted while another thread dispatches: lists and the index are published
+ * with release stores and walked with acquire loads, and a removed command keeps its links. Writers must be
+ * serialized by the caller, and a removed command must not be reused until readers that may hold it are done.
  * @param cli Pointer to CLI object.
  * @param name Command name.
  * @return Error code.
@@ -236,9 +454,31 @@ int qcli_insert(Qcli *cli, QcliCmd *cmd);
  */
 QcliCmd *qcli_find(Qcli *cli, const char *name);
 
+/**
+ * @brief Find a command by its path of space separated names, e.g. "net if eth0".
+ * @param cli Pointer to CLI object.
+ * @param path Command path.
+ * @return Pointer to command or NULL.
+ */
+QcliCmd *qcli_path_find(Qcli *cli, const char *path);
+
+/**
+ * @brief Resolve the deepest command matched by the leading argv tokens.
+ *
+ * Each token is looked up among the children of the previous match, so the cost
+ * grows with the depth of the tree rather than the number of commands.
+ *
+ * @param cli Pointer to CLI object.
+ * @param argc Number of arguments.
+ * @param argv Argument array.
+ * @param depth Receives the number of tokens consumed by the command path, may be NULL.
+ * @return Pointer to command or NULL if argv[0] is not a command.
+ */
+QcliCmd *qcli_resolve(Qcli *cli, int argc, char **argv, int *depth);
+
 /**
  * @brief Add a subcommand to a parent command.
- * @param parent Parent command structure.
+ * @param parent Parent command structure, top-level or a subcommand itself.
  * @param cmd Pointer to subcommand structure.
  * @param name Subcommand name.
  * @param cb Callback function.
@@ -255,6 +495,26 @@ int qcli_sub_add(QcliCmd *parent, QcliCmd *cmd, const char *name, QcmdCallback c
  */
 QcliCmd *qcli_sub_find(QcliCmd *parent, const char *name);
 
+/**
+ * @brief Replace the callback of a registered command, e.g. to wrap it.
+ * Dispatches started afterwards and compiled handles use the new callback.
+ * @param cmd Registered command or subcommand.
+ * @param cb New callback.
+ * @return Error code, QCLI_ERR_PARAM for the built-in commands, which take the cli pointer.
+ */
+int qcli_cb_set(QcliCmd *cmd, QcmdCallback cb);
+
+/**
+ * @brief Set a callback that runs instead of `cb` and gets the node, e.g. to wrap a command without a table of the
+ * commands wrapped. Argument table keys are still dispatched to their entries.
+ * Dispatches started afterwards and compiled handles use the new callback.
+ * @param cmd Registered command or subcommand.
+ * @param ncb Node callback, NULL to run `cb` again.
+ * @return Error code, QCLI_ERR_PARAM for the built-in commands, which take the cli pointer, or for NULL on a node
+ *         added by qcli_node_add().
+ */
+int qcli_node_cb_set(QcliCmd *cmd, QcmdNodeCallback ncb);
+
 /**
  * @brief Execute a character input for the CLI.
  * @param cli Pointer to CLI object.
@@ -264,11 +524,155 @@ QcliCmd *qcli_sub_find(QcliCmd *parent, const char *name);
 int qcli_exec(Qcli *cli, char c);
 
 /**
- * @brief Echo a command string to the CLI.
+ * @brief Split a command line into space separated tokens in place, without the QCLI_CMD_STR_MAX limit.
+ * The sequence operators ";", "&&" and "||" become tokens of their own, spaces around them are optional.
+ * Text in single quotes is kept in one token with its spaces and operators, the quotes are removed.
+ * @param str Line, str[len] must be writable and is set to '\0'.
+ * @param len Line length.
+ * @param argv Receives pointers into str and operator constants, QCLI_CMD_ARGC_MAX + 1 entries for qcli_dispatch().
+ * @param argc Receives the number of tokens.
+ * @return Error code, QCLI_ERR_PARAM for a blank line, QCLI_ERR_PARAM_MORE for too many tokens.
+ */
+int qcli_tokenize(char *str, size_t len, char **argv, int *argc);
+
+/**
+ * @brief Check whether a token is a sequence operator made by the tokenizer.
+ * Operators are told apart by pointer, so a quoted ';' or an argv entry built elsewhere is an argument.
+ * @param tok Token.
+ * @return 1 for ";", "&&" or "||" from qcli_tokenize() or a typed line, else 0.
+ */
+int qcli_seq_op(const char *tok);
+
+/**
+ * @brief Run an already tokenized command, without echo, history or prompt.
+ *
+ * Operator tokens ";", "&&" and "||" split argv into a sequence run left to right. A command after "&&" runs only
+ * if the last status is QCLI_EOK, after "||" only if it is not, after ";" always. The same applies to typed lines.
+ * Only tokens made by qcli_tokenize() are operators, see qcli_seq_op().
+ * Operators inside a "{" ... "}" group are not split, the group is passed to the command, e.g. "par { a ; b }".
+ *
  * @param cli Pointer to CLI object.
- * @param str Command string.
+ * @param argc Number of arguments.
+ * @param argv Argument array, with room for argc + 1 entries (built-ins get the cli appended).
+ * @return Result of the last command run, QCLI_ERR_NOT_FOUND if it is not a command, QCLI_ERR_PARAM if an
+ *         operator has no command on one side.
+ */
+int qcli_dispatch(Qcli *cli, int argc, char **argv);
+
+/**
+ * @brief Initialize an input ring.
+ * @param ring Ring to initialize.
+ * @param buf Storage.
+ * @param size Storage size, must be a power of two.
  * @return Error code.
  */
+int qcli_ring_init(QcliRing *ring, uint8_t *buf, size_t size);
+
+/**
+ * @brief Push a byte, safe to call from an interrupt handler (single producer).
+ * @param ring Input ring.
+ * @param c Input byte.
+ * @return 0 on success, -1 if the ring is full (counted in `overruns`).
+ */
+int qcli_ring_push(QcliRing *ring, uint8_t c);
+
+/**
+ * @brief Pop a byte (single consumer).
+ * @param ring Input ring.
+ * @param c Receives the byte.
+ * @return 0 on success, -1 if the ring is empty.
+ */
+int qcli_ring_pop(QcliRing *ring, uint8_t *c);
+
+/**
+ * @brief Attach an input ring to the CLI for qcli_poll().
+ * @param cli Pointer to CLI object.
+ * @param ring Input ring, NULL to detach.
+ * @return Error code.
+ */
+int qcli_ring_attach(Qcli *cli, QcliRing *ring);
+
+/**
+ * @brief Drain the input ring and execute its bytes, from the main loop.
+ * @param cli Pointer to CLI object.
+ * @param budget Maximum number of bytes to process, 0 for all available.
+ * @return Number of bytes processed or -1 on error.
+ */
+int qcli_poll(Qcli *cli, size_t budget);
+
+/**
+ * @brief Drain the input ring until it is empty or a time budget is spent.
+ *
+ * The budget is checked between bytes, so a command callback running on Enter may overrun it.
+ *
+ * @param cli Pointer to CLI object.
+ * @param tick Tick source.
+ * @param ticks Time budget in ticks of `tick`.
+ * @return Number of bytes processed or -1 on error.
+ */
+int qcli_poll_for(Qcli *cli, QcliTick tick, uint32_t ticks);
+
+#if QCLI_PROF
+/**
+ * @brief Set the profiler hook. Each stage is reported on the thread running it, a hook shared by threads
+ * dispatching concurrently must keep its state per thread.
+ * @param cli Pointer to CLI object.
+ * @param hook Profiler hook, NULL to stop profiling.
+ * @return Error code.
+ */
+int qcli_prof_hook(Qcli *cli, QcliProfHook hook);
+#endif
+
+/**
+ * @brief Tokenize and resolve a command line once, for repeated qcli_invoke().
+ * A line with sequence operators is dispatched as in qcli_dispatch() on each invoke.
+ * The handle is resolved again by qcli_invoke() only after the command tree changed, a command that is
+ * not found yet is picked up once it is added.
+ * @param cli Pointer to CLI object.
+ * @param h Handle to fill.
+ * @param str Command line, including subcommand path and arguments.
+ * @return Error code, QCLI_ERR_NOT_FOUND if the command does not exist (the handle is still usable). Never
+ * QCLI_ERR_NOT_FOUND for a sequence, whose commands are looked up as it runs.
+ */
+int qcli_compile(Qcli *cli, QcliHandle *h, const char *str);
+
+/**
+ * @brief Resolve an already tokenized command line once, for repeated qcli_invoke().
+ * As qcli_compile() without the QCLI_CMD_STR_MAX limit: the handle keeps the token pointers, which must stay valid
+ * and unchanged while it is used, e.g. tokens of qcli_tokenize() in storage owned by the caller.
+ * @param cli Pointer to CLI object.
+ * @param h Handle to fill.
+ * @param argc Number of tokens.
+ * @param argv Tokens.
+ * @return Error code as qcli_compile().
+ */
+int qcli_compile_argv(Qcli *cli, QcliHandle *h, int argc, char **argv);
+
+/**
+ * @brief Run a compiled command: no parsing, copying or lookup while the command tree is unchanged.
+ * Callbacks get the handle's token array and must not modify it.
+ * @param h Compiled handle.
+ * @return Callback result, or QCLI_ERR_NOT_FOUND.
+ */
+int qcli_invoke(QcliHandle *h);
+
+/**
+ * @brief Run a compiled command on other tokens, e.g. with arguments substituted or appended. The handle is only
+ * read, so it can be shared between threads. Falls back to qcli_dispatch() while the command tree differs from
+ * the resolution or for sequences.
+ * @param h Compiled handle.
+ * @param argc Number of tokens.
+ * @param argv Tokens starting with the handle's command path and table key, with room for argc + 1 entries.
+ * @return Callback result, or an error code as qcli_dispatch().
+ */
+int qcli_invoke_argv(const QcliHandle *h, int argc, char **argv);
+
+/**
+ * @brief Run a command string, without echo, history or prompt. The line being typed is kept.
+ * @param cli Pointer to CLI object.
+ * @param str Command string.
+ * @return Callback result or error code.
+ */
 int qcli_xstr(Qcli *cli, char *str);
 
 #ifdef __cplusplus
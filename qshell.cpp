@@ -9,13 +9,20 @@
 #ifdef _WIN32
 #include <Windows.h>
 #include <conio.h>
+#include <io.h>
 #else
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #endif
+#include <algorithm>
 #include <cstdarg>
+#include <cstddef>
 #include "qshell.h"
 
 void set_echo(bool enable)
@@ -43,10 +50,11 @@ void set_echo(bool enable)
 #endif
 }
 
+// Returns the byte read as 0..255, EOF when nothing was read
 int keyboard_getch()
 {
-    char c = 0;
 #ifdef _WIN32
+    int c = EOF;
     HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
     DWORD mode;
 
@@ -62,43 +70,415 @@ int keyboard_getch()
     }
 
     SetConsoleMode(hStdin, mode);
+    return c;
 #else
-    c = getchar();
-#endif
+    // read() instead of getchar() so that keyboard_wait() is not fooled by bytes buffered in stdio
+    unsigned char c = 0;
+    if(read(STDIN_FILENO, &c, 1) != 1) {
+        return EOF;
+    }
     return c;
+#endif
+}
+
+// Waits up to `ms` (-1: forever) for a key, returns true when one is available
+bool keyboard_wait(int ms)
+{
+#ifdef _WIN32
+    return WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE), ms < 0 ? INFINITE : (DWORD)ms) == WAIT_OBJECT_0;
+#else
+    struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+    return ::poll(&fd, 1, ms) != 0;
+#endif
+}
+
+// Maps a file copy-on-write so that lines can be terminated in place, data is null for an empty file
+static bool map_file(const char *path, char *&data, size_t &size)
+{
+    data = nullptr;
+    size = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if(file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER len;
+    bool ok = GetFileSizeEx(file, &len) != 0;
+    if(ok && len.QuadPart > 0) {
+        HANDLE map = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+        if(map != nullptr) {
+            data = (char *)MapViewOfFile(map, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(map);
+        }
+        ok = data != nullptr;
+        size = ok ? (size_t)len.QuadPart : 0;
+    }
+    CloseHandle(file);
+    return ok;
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if(ok && st.st_size > 0) {
+        void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ok = p != MAP_FAILED;
+        if(ok) {
+            data = (char *)p;
+            size = (size_t)st.st_size;
+            posix_madvise(p, size, POSIX_MADV_SEQUENTIAL);
+        }
+    }
+    close(fd);
+    return ok;
+#endif
+}
+
+static void unmap_file(char *data, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+thread_local QShell *QShell::self_ = nullptr;
+thread_local std::string *QShell::capture_ = nullptr;
+QShell *QShell::default_ = nullptr;
+
+static constexpr uint8_t FRAME_SYNC = 0xa5;
+static constexpr size_t FRAME_HEAD = 4;
+static constexpr size_t FRAME_OUT_MAX = 0xffff;
+static constexpr uint32_t WATCH_TICK_MS = 10;
+static constexpr uint8_t STREAM_SYNC = 0xa6;
+static constexpr size_t PIPE_BLOCK = 64 * 1024;
+static constexpr int ALIAS_NEST_MAX = 8;
+static constexpr size_t CACHE_KEYS_MAX = 64;
+
+#if QCLI_PROF
+// Open profiler spans of the current thread, deeper nesting is not timed
+struct PerfSpan {
+    QcliStage stage;
+    uint32_t nest;
+    uint64_t start;
+    uint64_t child;
+};
+static constexpr int PERF_DEPTH = 16;
+static thread_local PerfSpan perf_spans[PERF_DEPTH];
+static thread_local int perf_depth = 0;
+
+static const char *const PERF_STAGES[QCLI_STAGE_NUM] = { "read", "decode", "parse", "dispatch", "callback", "output" };
+
+static uint64_t perf_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
 }
+#endif
 
 QShell::QShell(QcliPrint print, GetChFunc getch)
 {
-    this->getch = getch;
-    qcli_init(&cli, print);
-    inited = true;
+    init(print, getch);
 }
 
-QShell::~QShell()
+QcliCmd *QShell::CmdPool::alloc()
+{
+    if(free_list == nullptr) {
+        size_t n = grow;
+        grow *= 2;
+        Slot *slab = new Slot[n];
+        for(size_t i = n; i-- > 0;) {
+            slab[i].next = free_list;
+            free_list = &slab[i];
+        }
+        slabs.emplace_back(slab, n);
+    }
+    Slot *slot = free_list;
+    free_list = slot->next;
+    used_++;
+    slot->cmd.owner = this;
+    return &slot->cmd;
+}
+
+QcliCmd *QShell::CmdPool::alloc_n(size_t n)
 {
-    for(auto it = cmds_addr.begin(); it != cmds_addr.end(); ++it) {
-        QcliCmd *cmd = (QcliCmd *)(*it);
-        delete cmd;
+    if(n == 0) {
+        return nullptr;
     }
-    cmds_addr.clear();
+    Slot *slab = new Slot[n];
+    slabs.emplace_back(slab, n);
+    used_ += n;
+    for(size_t i = 0; i < n; i++) {
+        slab[i].cmd.owner = this;
+    }
+    return &slab[0].cmd;
+}
+
+void QShell::CmdPool::free(QcliCmd *cmd)
+{
+    Slot *slot = reinterpret_cast<Slot *>(cmd);
+    slot->next = free_list;
+    free_list = slot;
+    used_--;
+}
+
+bool QShell::CmdPool::owns(const QcliCmd *cmd) const
+{
+    return cmd->owner == this;
+}
+
+QShell::~QShell()
+{
     exit();
+    var_stream_stop();
+    par_stop_();
+    output_buffer(0);
+    if(default_ == this) {
+        default_ = nullptr;
+    }
 }
 
 void QShell::init(QcliPrint print, GetChFunc getch)
 {
     this->getch = getch;
-    qcli_init(&cli, print);
+    out = print;
+    default_ = this;
+    qcli_init(&cli, print_hook_);
+    help_cache(16 * 1024);
+#if QCLI_PROF
+    qcli_prof_hook(&cli, perf_hook_);
+    cmd_add("perf", perf_cb_, "[-h]: time per input stage, -h adds histograms");
+    cmd_sub_add("perf", "reset", perf_reset_cb_, "clear the profile");
+#endif
+    cmd_add("frame", frame_cb_, "enter framed machine-control mode");
+    cmd_add("watch", watch_cb_, "[-n ms] <cmd ...>: rerun a command, any key stops");
+    cmd_add("alias", alias_cb_, "[name[='line']]: define or list aliases, $1..$9 take arguments");
+    cmd_add("unalias", unalias_cb_, "<name>: delete an alias");
+    cmd_add("cache", cache_cb_, "cached commands with their hit counters");
+    cmd_sub_add("cache", "clear", cache_clear_cb_, "[path]: drop cached results");
+    cmd_add("par", par_cb_, "'cmd ; cmd ...': run commands concurrently, output in order");
+    cmd_add("source", source_cb_, "[-k] <file>: run commands from a file, -k continues after errors");
+    cmd_add("var", var_cb_, "live variables");
+    cmd_sub_add("var", "list", var_list_cb_, "list variables");
+    cmd_sub_add("var", "get", var_get_cb_, "<name ...>: read variables");
+    cmd_sub_add("var", "set", var_set_cb_, "<name> <value>: write a variable");
+    cmd_sub_add("var", "stream", var_stream_cb_, "[-b] <name ...> <hz>: sample to csv or binary, any key stops");
     inited = true;
 }
 
+int QShell::print_hook_(const char *fmt, ...)
+{
+    QShell *sh = self_ != nullptr ? self_ : default_;
+    char stack[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(stack, sizeof(stack), fmt, args);
+    va_end(args);
+    if(len < 0 || sh == nullptr) {
+        return -1;
+    }
+
+    if((size_t)len < sizeof(stack)) {
+        sh->write_(stack, len);
+    } else {
+        std::string buf(len + 1, '\0');
+        va_start(args, fmt);
+        vsnprintf(buf.data(), len + 1, fmt, args);
+        va_end(args);
+        sh->write_(buf.data(), len);
+    }
+    return len;
+}
+
+void QShell::write_(const char *data, size_t len)
+{
+    Stage stage(this, QCLI_STAGE_OUTPUT);
+    if(capture_ != nullptr) {
+        capture_->append(data, len);
+    } else if(std::shared_ptr<OutQueue> q = outq_()) {
+        out_enqueue_(*q, data, len);
+    } else {
+        sink_(data, len);
+    }
+}
+
+size_t QShell::tx_bytes() const
+{
+    return std::atomic_ref<size_t>(const_cast<size_t &>(cli.tx_bytes)).load(std::memory_order_relaxed);
+}
+
+std::shared_ptr<QShell::OutQueue> QShell::outq_()
+{
+    if(!buffered.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(outq_mtx);
+    return outq;
+}
+
+void QShell::sink_(const char *data, size_t len)
+{
+    if(out == nullptr) {
+        return;
+    }
+    // %.*s stops at NUL, so NUL bytes of binary output go out with %c
+    while(len > 0) {
+        const char *nul = (const char *)memchr(data, '\0', len);
+        size_t n = nul != nullptr ? nul - data : len;
+        if(n > 0) {
+            out("%.*s", (int)n, data);
+        }
+        if(nul != nullptr) {
+            out("%c", '\0');
+            n++;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+void QShell::OutQueue::push(const char *data, size_t len)
+{
+    size_t cap = buf.size();
+    size_t tail = (head + size) % cap;
+    size_t n = std::min(len, cap - tail);
+    memcpy(buf.data() + tail, data, n);
+    memcpy(buf.data(), data + n, len - n);
+    size += len;
+}
+
+void QShell::out_enqueue_(OutQueue &q, const char *data, size_t len)
+{
+    std::unique_lock<std::mutex> lock(q.mtx);
+    size_t cap = q.buf.size();
+    if(q.stop) {
+        lock.unlock();
+        sink_(data, len);
+        return;
+    }
+
+    if(q.policy == OutPolicy::Block) {
+        while(len > 0) {
+            q.space_cv.wait(lock, [&] { return q.size < cap || q.stop; });
+            if(q.stop) {
+                lock.unlock();
+                sink_(data, len);
+                return;
+            }
+            size_t n = std::min(len, cap - q.size);
+            q.push(data, n);
+            data += n;
+            len -= n;
+            q.data_cv.notify_one();
+        }
+        return;
+    }
+
+    if(q.policy == OutPolicy::DropNewest) {
+        size_t n = std::min(len, cap - q.size);
+        q.push(data, n);
+        q.dropped += len - n;
+    } else {
+        if(len > cap) {
+            q.dropped += len - cap;
+            data += len - cap;
+            len = cap;
+        }
+        size_t room = cap - q.size;
+        if(room < len) {
+            size_t drop = len - room;
+            q.head = (q.head + drop) % cap;
+            q.size -= drop;
+            q.dropped += drop;
+        }
+        q.push(data, len);
+    }
+    q.data_cv.notify_one();
+}
+
+void QShell::out_drain_(OutQueue &q)
+{
+    std::string chunk;
+    for(;;) {
+        std::unique_lock<std::mutex> lock(q.mtx);
+        q.data_cv.wait(lock, [&] { return q.size > 0 || q.dropped != q.reported || q.stop; });
+        if(q.size == 0 && q.dropped == q.reported && q.stop) {
+            break;
+        }
+        uint64_t drop = q.dropped - q.reported;
+        q.reported = q.dropped;
+        size_t cap = q.buf.size();
+        size_t n = std::min(q.size, cap - q.head);
+        chunk.assign(q.buf.data() + q.head, n);
+        chunk.append(q.buf.data(), q.size - n);
+        q.head = 0;
+        q.size = 0;
+        lock.unlock();
+        q.space_cv.notify_all();
+
+        if(drop > 0) {
+            char mark[64];
+            int len = snprintf(mark, sizeof(mark), "\r\n #! %llu bytes dropped !\r\n", (unsigned long long)drop);
+            sink_(mark, len);
+        }
+        sink_(chunk.data(), chunk.size());
+    }
+}
+
+int QShell::output_buffer(size_t capacity, OutPolicy policy)
+{
+    // Writers that still hold the old queue see stop and write to the sink themselves
+    std::shared_ptr<OutQueue> old;
+    {
+        std::lock_guard<std::mutex> lock(outq_mtx);
+        old.swap(outq);
+        buffered.store(false, std::memory_order_release);
+    }
+    if(old) {
+        {
+            std::lock_guard<std::mutex> lock(old->mtx);
+            old->stop = true;
+        }
+        old->data_cv.notify_one();
+        old->space_cv.notify_all();
+        old->thr.join();
+    }
+    if(capacity == 0) {
+        return 0;
+    }
+
+    auto q = std::make_shared<OutQueue>();
+    q->buf.resize(capacity);
+    q->policy = policy;
+    q->thr = std::thread(&QShell::out_drain_, this, std::ref(*q));
+    std::lock_guard<std::mutex> lock(outq_mtx);
+    outq = std::move(q);
+    buffered.store(true, std::memory_order_release);
+    return 0;
+}
+
+uint64_t QShell::output_dropped()
+{
+    std::shared_ptr<OutQueue> q = outq_();
+    if(!q) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(q->mtx);
+    return q->dropped;
+}
+
 int QShell::start()
 {
     if(!inited) {
         return -1;
     }
 
-    thr = std::thread(&QShell::exec, this);
+    thr = std::thread(&QShell::exec, this, ExecMode::Auto);
 
     return 0;
 }
@@ -136,16 +516,17 @@ int QShell::println(const char *fmt, ...)
     va_end(args2);
 
     if(sz < 0) {
-        cli.print(" #! QShell::echo: vsnprintf failed\r\n");
+        print(" #! QShell::echo: vsnprintf failed\r\n");
         return -1;
     }
 
     if(sz != len) {
-        cli.print(" #! QShell::echo: length mismatch, expected: %d, actual: %d\r\n", len, sz);
+        print(" #! QShell::echo: length mismatch, expected: %d, actual: %d\r\n", len, sz);
         return -1;
     }
 
-    cli.print("%s\r\n", buf.data());
+    write_(buf.data(), len);
+    write_("\r\n", 2);
     return 0;
 }
 
@@ -173,16 +554,16 @@ int QShell::print(const char *fmt, ...)
     va_end(args2);
 
     if(sz < 0) {
-        cli.print(" #! QShell::echo: vsnprintf failed\r\n");
+        print(" #! QShell::echo: vsnprintf failed\r\n");
         return -1;
     }
 
     if(sz != len) {
-        cli.print(" #! QShell::echo: length mismatch, expected: %d, actual: %d\r\n", len, sz);
+        print(" #! QShell::echo: length mismatch, expected: %d, actual: %d\r\n", len, sz);
         return -1;
     }
 
-    cli.print("%s", buf.data());
+    write_(buf.data(), len);
     return 0;
 }
 
@@ -191,144 +572,2392 @@ int QShell::cmd_add(const char *name, QShellCmdHandler handler, const char *desc
     if(name == nullptr || handler == nullptr || desc == nullptr) {
         return -1;
     }
-    QcliCmd *cmd = new QcliCmd;
+    RegLock lock(this);
+    index_reserve_(cli.cmds_n + 1);
+    QcliCmd *cmd = pool.alloc();
     int ret = qcli_add(&cli, cmd, name, handler, desc);
     if(ret != 0) {
-        delete cmd;
-        return ret;
+        pool.free(cmd);
+    }
+    return ret;
+}
+
+int QShell::cmd_add_many(QcliDesc *descs, size_t n)
+{
+    if(descs == nullptr || n == 0) {
+        return 0;
+    }
+
+    RegLock lock(this);
+    index_reserve_(cli.cmds_n + n);
+    QcliCmd *cmds = pool.alloc_n(n);
+    int ret = qcli_add_bulk(&cli, descs, cmds, n);
+    for(size_t i = 0; i < n; i++) {
+        if(cmds[i].cli == nullptr) {
+            pool.free(&cmds[i]);
+        }
     }
-    cmds_addr.push_back((uintptr_t)cmd);
     return ret;
 }
 
+int QShell::cmd_add_many(QcliDesc *descs, QcliCmd *cmds, size_t n)
+{
+    if(descs == nullptr || cmds == nullptr || n == 0) {
+        return 0;
+    }
+
+    RegLock lock(this);
+    index_reserve_(cli.cmds_n + n);
+    for(size_t i = 0; i < n; i++) {
+        cmds[i].owner = nullptr;
+    }
+    return qcli_add_bulk(&cli, descs, cmds, n);
+}
+
+void QShell::index_reserve_(size_t n)
+{
+    if(n <= cli.hsize * 2) {
+        return;
+    }
+    size_t size = cli.hsize;
+    while(size * 2 < n) {
+        size *= 2;
+    }
+    std::vector<QcliCmd *> grown(size);
+    qcli_hash_set(&cli, grown.data(), size);
+    buckets.swap(grown);
+    if(!grown.empty()) {
+        retired.push_back({ epoch.load(), nullptr, std::move(grown), nullptr });
+        retired_n++;
+    }
+}
+
 int QShell::cmd_del(const char *name)
 {
     if(name == nullptr) {
         return -1;
     }
 
+    RegLock lock(this);
     QcliCmd *cmd = qcli_find(&cli, name);
+    if(cmd != nullptr && cmd->ncb == alias_run_) {
+        alias_del_(name); // the alias owns its node
+        return 0;
+    }
+    if(cmd != nullptr) {
+        cache_forget_(cmd);
+    }
     if(qcli_del(&cli, name) == 0) {
-        for(auto it = cmds_addr.begin(); it != cmds_addr.end(); ++it) {
-            if(*it == (uintptr_t)cmd) {
-                cmds_addr.erase(it);
-                break;
-            }
-        }
-        delete cmd;
+        retired.push_back({ epoch.load(), cmd, {}, nullptr });
+        retired_n++;
     }
+    reclaim_();
 
     return 0;
 }
 
+QShell::ReadGuard::ReadGuard(QShell *sh) : sh(sh)
+{
+    // Retry if the epoch moved between reading it and announcing this reader in its phase
+    for(;;) {
+        epoch = sh->epoch.load();
+        sh->readers[epoch & 1]++;
+        if(sh->epoch.load() == epoch) {
+            break;
+        }
+        sh->readers[epoch & 1]--;
+    }
+}
+
+QShell::ReadGuard::~ReadGuard()
+{
+    sh->readers[epoch & 1]--;
+    // Under its own RegLock the thread leaves reclaiming to the writer, try_lock() would be undefined
+    std::thread::id self = std::this_thread::get_id();
+    if(sh->retired_n.load() > 0 && sh->reg_owner.load(std::memory_order_relaxed) != self && sh->reg_mtx.try_lock()) {
+        sh->reg_owner.store(self, std::memory_order_relaxed);
+        sh->reclaim_();
+        sh->reg_owner.store({}, std::memory_order_relaxed);
+        sh->reg_mtx.unlock();
+    }
+}
+
+QShell::RegLock::RegLock(QShell *sh) : sh(sh)
+{
+    sh->reg_mtx.lock();
+    sh->reg_owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+}
+
+QShell::RegLock::~RegLock()
+{
+    sh->reg_owner.store({}, std::memory_order_relaxed);
+    sh->reg_mtx.unlock();
+}
+
+void QShell::reclaim_()
+{
+    if(retired.empty()) {
+        return;
+    }
+    for(int i = 0; i < 2; i++) {
+        uint64_t e = epoch.load();
+        if(readers[(e + 1) & 1].load() != 0) {
+            break;
+        }
+        epoch.compare_exchange_strong(e, e + 1);
+    }
+    uint64_t now = epoch.load();
+    auto keep = std::remove_if(retired.begin(), retired.end(), [&](Retired &r) {
+        if(r.epoch + 2 > now) {
+            return false;
+        }
+        if(r.cmd != nullptr) {
+            cmd_release_(r.cmd);
+        }
+        return true;
+    });
+    retired.erase(keep, retired.end());
+    retired_n = retired.size();
+}
+
+void QShell::cmd_release_(QcliCmd *cmd)
+{
+    QcliList *node = cmd->sublevel.next;
+    while(node != &cmd->sublevel) {
+        QcliList *next = node->next;
+        cmd_release_(reinterpret_cast<QcliCmd *>(reinterpret_cast<char *>(node) - offsetof(QcliCmd, node)));
+        node = next;
+    }
+    if(pool.owns(cmd)) {
+        pool.free(cmd);
+    }
+}
+
 int QShell::cmd_sub_add(const char *parent_name, const char *subcmd_name, QShellCmdHandler handler, const char *desc)
 {
     if(parent_name == nullptr || subcmd_name == nullptr || handler == nullptr || desc == nullptr) {
         return -1;
     }
 
-    QcliCmd *parent = qcli_find(&cli, parent_name);
+    RegLock lock(this);
+    QcliCmd *parent = qcli_path_find(&cli, parent_name);
     if(parent == nullptr) {
         return -1;
     }
 
-    QcliCmd *subcmd = new QcliCmd;
+    index_reserve_(cli.cmds_n + 1);
+    QcliCmd *subcmd = pool.alloc();
     int ret = qcli_sub_add(parent, subcmd, subcmd_name, handler, desc);
     if(ret != 0) {
-        delete subcmd;
-        return ret;
+        pool.free(subcmd);
     }
-    cmds_addr.push_back((uintptr_t)subcmd);
     return ret;
 }
 
-int QShell::xstr(std::string str)
+int QShell::cmd_table_set(const char *name, ArgsTable *table, size_t table_size)
 {
-    if(str.empty()) {
+    if(name == nullptr) {
         return -1;
     }
-    qcli_xstr(&cli, (char *)str.c_str());
-    return 0;
+
+    RegLock lock(this);
+    QcliCmd *cmd = qcli_path_find(&cli, name);
+    if(cmd == nullptr) {
+        return -1;
+    }
+
+    return qcli_table_bind(cmd, table, table_size);
 }
 
-void QShell::exec()
+int QShell::help_cache(size_t size)
 {
-    set_echo(false);
-
-    std::this_thread::sleep_for(std::chrono::milliseconds(200));
-    while(!is_exit) {
-        int c = 0;
-        if(getch != nullptr) {
-            c = getch();
-        } else {
-            c = keyboard_getch();
-        }
-        if(c == 0 || c == EOF) {
-            continue;
-        }
-        if(c == 3) { // ctrl+c
-            cli.print("\33[2K");
-            cli.print("\033[H\033[J");
-            cli.print("\r\n -QSH EXIT-\r\n");
-            break;
-        }
+    for(int mode = 0; mode < 2; mode++) {
+        help_buf[mode].assign(size, '\0');
+        qcli_help_cache(&cli, mode, help_buf[mode].data(), size);
+    }
+    return 0;
+}
 
-#ifdef _WIN32
-        if(c == 0xe0) {
-            qcli_exec(&cli, c);
-            int next_c = 0;
-            if(getch != nullptr) {
-                next_c = getch();
-            } else {
-                next_c = keyboard_getch();
-            }
-            if(next_c != 0 && next_c != EOF) {
-                if(next_c == 3) {
-                    cli.print("\33[2K");
-                    cli.print("\033[H\033[J");
-                    cli.print(" \r\n#! QCLI Exit !\r\n");
-                    break;
-                }
-                qcli_exec(&cli, next_c);
-            }
-            continue;
-        } else {
-            qcli_exec(&cli, c);
-        }
-#else
-        if(c == 27) {
-            qcli_exec(&cli, c);
-            int next_c1 = keyboard_getch();
-            if(next_c1 != 0 && next_c1 != EOF) {
-                qcli_exec(&cli, next_c1);
-                if(next_c1 == 91) {
-                    int next_c2 = keyboard_getch();
-                    if(next_c2 != 0 && next_c2 != EOF) {
-                        qcli_exec(&cli, next_c2);
-                    }
-                }
-            }
-            continue;
-        } else {
-            qcli_exec(&cli, c);
+size_t QShell::path_depth_(const char *path)
+{
+    size_t n = 0;
+    for(const char *p = path; p != nullptr && *p != '\0'; p++) {
+        if(*p != ' ' && (p == path || p[-1] == ' ')) {
+            n++;
         }
-#endif
-        c = (c == 127) ? 8 : c;
-        std::this_thread::sleep_for(std::chrono::milliseconds(5));
     }
-    set_echo(true);
+    return n;
+}
 
-    if(on_exit) {
-        on_exit();
+int QShell::xstr(const std::string &str)
+{
+    if(str.empty()) {
+        return -1;
     }
+    Scope scope(this);
+    ReadGuard guard(this);
+    return qcli_xstr(&cli, const_cast<char *>(str.c_str()));
 }
 
-int QShell::execc(char c)
+int QShell::capture(const std::string &cmdline, std::string &out)
 {
-    qcli_exec(&cli, c);
+    out.clear();
+    std::string line(cmdline);
+    char *argv[QCLI_CMD_ARGC_MAX + 1];
+    int argc = 0;
+    int ret = QCLI_EOK;
+    {
+        Stage stage(this, QCLI_STAGE_PARSE);
+        ret = qcli_tokenize(line.data(), line.size(), argv, &argc);
+    }
+    if(ret != QCLI_EOK) {
+        return ret;
+    }
+    Scope scope(this);
+    ReadGuard guard(this);
+    std::string *prev = capture_;
+    capture_ = &out;
+    ret = qcli_dispatch(&cli, argc, argv);
+    capture_ = prev;
+    return ret;
+}
+
+int QShell::compile(CmdHandle &h, const char *cmdline)
+{
+    ReadGuard guard(this);
+    return qcli_compile(&cli, &h, cmdline);
+}
+
+int QShell::invoke(CmdHandle &h)
+{
+    Scope scope(this);
+    ReadGuard guard(this);
+    return qcli_invoke(&h);
+}
+
+int QShell::Script::fail_(int line, const char *msg)
+{
+    err = "line " + std::to_string(line) + ": " + msg;
+    return QCLI_ERR_PARAM;
+}
+
+int QShell::Script::slot_(std::string_view name)
+{
+    for(size_t i = 0; i < names.size(); i++) {
+        if(names[i] == name) {
+            return (int)i;
+        }
+    }
+    names.emplace_back(name);
+    vals.emplace_back();
+    return (int)names.size() - 1;
+}
+
+QShell::Script::Arg QShell::Script::arg_(std::string_view tok)
+{
+    if(tok.size() > 1 && tok[0] == '$') {
+        return Arg{ std::string(tok), slot_(tok.substr(1)) };
+    }
+    return Arg{ std::string(tok), -1 };
+}
+
+const std::string &QShell::Script::val_(const Arg &a)
+{
+    if(a.slot < 0) {
+        return a.text;
+    }
+    // $? is formatted only when read
+    if(a.slot == 0 && status_dirty) {
+        vals[0] = std::to_string(status);
+        status_dirty = false;
+    }
+    return vals[a.slot];
+}
+
+bool QShell::Script::int_(const Arg &a, int64_t &v)
+{
+    const std::string &s = val_(a);
+    auto r = std::from_chars(s.data(), s.data() + s.size(), v);
+    return !s.empty() && r.ec == std::errc() && r.ptr == s.data() + s.size();
+}
+
+int QShell::Script::node_(const std::vector<std::string_view> &toks, std::string_view text, Node &n)
+{
+    std::string_view kw = toks[0];
+    size_t nt = toks.size();
+    bool block = toks.back() == "{";
+
+    if(kw == "repeat") {
+        if(nt != 3 || !block) {
+            return fail_(n.line, "expected 'repeat N {'");
+        }
+        n.op = Op::Repeat;
+        n.args.push_back(arg_(toks[1]));
+        return 1;
+    }
+    if(kw == "for") {
+        size_t dots = nt == 5 ? toks[3].find("..") : std::string_view::npos;
+        if(nt != 5 || toks[2] != "in" || !block || dots == std::string_view::npos || toks[1][0] == '$') {
+            return fail_(n.line, "expected 'for name in a..b {'");
+        }
+        n.op = Op::For;
+        n.var = slot_(toks[1]);
+        n.args.push_back(arg_(toks[3].substr(0, dots)));
+        n.args.push_back(arg_(toks[3].substr(dots + 2)));
+        return 1;
+    }
+    if(kw == "if") {
+        static const char *const ops[] = { "==", "!=", "<", ">", "<=", ">=" };
+        bool known =
+                nt == 5 && std::any_of(std::begin(ops), std::end(ops), [&](const char *o) { return toks[2] == o; });
+        if(!known || !block) {
+            return fail_(n.line, "expected 'if a op b {'");
+        }
+        n.op = Op::If;
+        n.cmp = toks[2];
+        n.args.push_back(arg_(toks[1]));
+        n.args.push_back(arg_(toks[3]));
+        return 1;
+    }
+    if(block) {
+        return fail_(n.line, "'{' after a command");
+    }
+    if(kw == "set") {
+        if(nt < 3 || toks[1][0] == '$') {
+            return fail_(n.line, "expected 'set name value'");
+        }
+        n.op = Op::Set;
+        n.var = slot_(toks[1]);
+        if(nt == 3) {
+            n.args.push_back(arg_(toks[2]));
+        } else {
+            // Several words are kept as literal text
+            const char *b = toks[2].data();
+            const char *e = toks.back().data() + toks.back().size();
+            n.args.push_back(Arg{ std::string(b, e), -1 });
+        }
+        return 0;
+    }
+    if(kw == "exit") {
+        if(nt > 2) {
+            return fail_(n.line, "expected 'exit [status]'");
+        }
+        n.op = Op::Exit;
+        if(nt == 2) {
+            n.args.push_back(arg_(toks[1]));
+        }
+        return 0;
+    }
+
+    n.op = Op::Cmd;
+    n.h = std::make_unique<CmdHandle>();
+    n.toks = std::make_unique<char[]>(text.size() + 1);
+    memcpy(n.toks.get(), text.data(), text.size());
+    char *argv[QCLI_CMD_ARGC_MAX + 1];
+    int argc = 0;
+    int ret = qcli_tokenize(n.toks.get(), text.size(), argv, &argc);
+    if(ret == QCLI_ERR_PARAM_MORE) {
+        return fail_(n.line, "too many tokens");
+    } else if(ret != QCLI_EOK) {
+        return fail_(n.line, "bad command line");
+    }
+    ret = qcli_compile_argv(&sh->cli, n.h.get(), argc, argv);
+    // A variable among the tokens picking the command or the table entry is looked up on each run
+    int depth = 0;
+    QcliCmd *cmd = qcli_resolve(&sh->cli, n.h->argc, n.h->argv, &depth);
+    if(cmd && cmd->table != nullptr) {
+        depth++;
+    }
+    for(int i = 0; i < n.h->argc; i++) {
+        Arg a = arg_(n.h->argv[i]);
+        if(a.slot >= 0 && (cmd == nullptr || i < depth)) {
+            n.op = Op::Dyn;
+        }
+        if(a.slot >= 0) {
+            n.subst.emplace_back(i, a.slot);
+        }
+        n.args.push_back(std::move(a));
+    }
+    if(n.op == Op::Dyn) {
+        n.h.reset();
+        n.toks.reset();
+        n.subst.clear();
+    } else {
+        n.args.clear();
+        if(ret == QCLI_ERR_NOT_FOUND) {
+            return fail_(n.line, "command not found");
+        }
+    }
+    return 0;
+}
+
+int QShell::Script::parse_(const std::vector<std::string_view> &lines, size_t &i, std::vector<Node> &out)
+{
+    std::vector<std::string_view> toks;
+    while(i < lines.size()) {
+        int line = (int)++i;
+        std::string_view text = lines[i - 1];
+        toks.clear();
+        size_t p = 0;
+        while(p < text.size()) {
+            size_t b = text.find_first_not_of(" \t\r", p);
+            if(b == std::string_view::npos) {
+                break;
+            }
+            p = std::min(text.find_first_of(" \t\r", b), text.size());
+            toks.push_back(text.substr(b, p - b));
+        }
+        if(toks.empty() || toks[0][0] == '#') {
+            continue;
+        }
+        if(toks[0] == "}") {
+            if(toks.size() == 1) {
+                return 1;
+            }
+            if(toks.size() == 3 && toks[1] == "else" && toks[2] == "{") {
+                return 2;
+            }
+            return fail_(line, "unexpected text after '}'");
+        }
+
+        Node &n = out.emplace_back();
+        n.line = line;
+        int ret = node_(toks, text.substr(toks[0].data() - text.data()), n);
+        if(ret <= 0) {
+            if(ret < 0) {
+                return ret;
+            }
+            continue;
+        }
+        ret = parse_(lines, i, n.body);
+        if(ret == 2 && n.op == Op::If) {
+            ret = parse_(lines, i, n.other);
+        }
+        if(ret < 0) {
+            return ret;
+        } else if(ret == 0) {
+            return fail_(line, "'{' is not closed");
+        } else if(ret == 2) {
+            return fail_(line, "'else' without 'if'");
+        }
+    }
+    return 0;
+}
+
+int QShell::Script::compile(QShell &shell, std::string_view src)
+{
+    sh = &shell;
+    prog.clear();
+    names.assign(1, "?");
+    vals.assign(1, "0");
+    err.clear();
+
+    std::vector<std::string_view> lines;
+    for(size_t p = 0; p <= src.size();) {
+        size_t e = src.find('\n', p);
+        if(e == std::string_view::npos) {
+            e = src.size();
+        }
+        lines.push_back(src.substr(p, e - p));
+        p = e + 1;
+    }
+
+    ReadGuard guard(sh);
+    size_t i = 0;
+    int ret = parse_(lines, i, prog);
+    if(ret == 1) {
+        ret = fail_((int)i, "'}' without '{'");
+    } else if(ret == 2) {
+        ret = fail_((int)i, "'else' without 'if'");
+    }
+    if(ret < 0) {
+        prog.clear();
+    }
+    return ret;
+}
+
+int QShell::Script::dyn_(Node &n)
+{
+    char *argv[QCLI_CMD_ARGC_MAX + 1];
+    std::string tok[QCLI_CMD_ARGC_MAX];
+    int argc = (int)n.args.size();
+    for(int i = 0; i < argc; i++) {
+        tok[i] = val_(n.args[i]);
+        argv[i] = tok[i].data();
+    }
+    return qcli_dispatch(&sh->cli, argc, argv);
+}
+
+int QShell::Script::exec_(std::vector<Node> &nodes)
+{
+    for(Node &n : nodes) {
+        switch(n.op) {
+        case Op::Cmd:
+            for(auto &[i, slot] : n.subst) {
+                n.h->argv[i] = const_cast<char *>(val_(Arg{ {}, slot }).c_str());
+            }
+            status = qcli_invoke(n.h.get());
+            status_dirty = true;
+            break;
+        case Op::Dyn:
+            status = dyn_(n);
+            status_dirty = true;
+            break;
+        case Op::Set:
+            vals[n.var] = val_(n.args[0]);
+            break;
+        case Op::Exit: {
+            int64_t v = status;
+            if(!n.args.empty() && !int_(n.args[0], v)) {
+                v = QCLI_ERR_PARAM_TYPE;
+            }
+            status = (int)v;
+            status_dirty = true;
+            stop = true;
+            break;
+        }
+        case Op::Repeat: {
+            int64_t count = 0;
+            if(!int_(n.args[0], count)) {
+                status = QCLI_ERR_PARAM_TYPE;
+                status_dirty = true;
+                break;
+            }
+            for(int64_t k = 0; k < count && !stop; k++) {
+                exec_(n.body);
+            }
+            break;
+        }
+        case Op::For: {
+            int64_t a = 0, b = 0;
+            if(!int_(n.args[0], a) || !int_(n.args[1], b)) {
+                status = QCLI_ERR_PARAM_TYPE;
+                status_dirty = true;
+                break;
+            }
+            int64_t step = a <= b ? 1 : -1;
+            for(int64_t k = a; !stop; k += step) {
+                char num[24];
+                auto r = std::to_chars(num, num + sizeof(num), k);
+                vals[n.var].assign(num, r.ptr);
+                exec_(n.body);
+                if(k == b) {
+                    break;
+                }
+            }
+            break;
+        }
+        case Op::If: {
+            int64_t a = 0, b = 0;
+            int c;
+            if(int_(n.args[0], a) && int_(n.args[1], b)) {
+                c = a < b ? -1 : a > b;
+            } else {
+                c = val_(n.args[0]).compare(val_(n.args[1]));
+            }
+            const std::string &op = n.cmp;
+            bool yes = op == "==" ? c == 0 : op == "!=" ? c != 0 : op == "<" ? c < 0 :
+                       op == ">"  ? c > 0  : op == "<=" ? c <= 0 : c >= 0;
+            exec_(yes ? n.body : n.other);
+            break;
+        }
+        }
+        if(stop) {
+            break;
+        }
+    }
+    return status;
+}
+
+int QShell::Script::run()
+{
+    if(sh == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    status = 0;
+    vals[0] = "0";
+    status_dirty = false;
+    stop = false;
+    Scope scope(sh);
+    ReadGuard guard(sh);
+    return exec_(prog);
+}
+
+int QShell::script(std::string_view src)
+{
+    Script s;
+    int ret = s.compile(*this, src);
+    if(ret < 0) {
+        tprintln(" script: {}", s.error());
+        return ret;
+    }
+    return s.run();
+}
+
+int QShell::run_script(const char *path, bool keep_going, std::vector<int> *status)
+{
+    if(path == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    if(status != nullptr) {
+        status->clear();
+    }
+    char *data = nullptr;
+    size_t size = 0;
+    if(!map_file(path, data, size)) {
+        tprintln(" {}: cannot open", path);
+        return QCLI_ERR_PARAM;
+    }
+    if(data == nullptr) {
+        return QCLI_EOK;
+    }
+
+    Scope scope(this);
+    ReadGuard guard(this);
+    std::string last;
+    int result = QCLI_EOK;
+    size_t lineno = 0;
+    for(char *p = data, *end = data + size; p < end;) {
+        char *nl = (char *)memchr(p, '\n', end - p);
+        char *line = p;
+        size_t len;
+        if(nl != nullptr) {
+            len = nl - p;
+            p = nl + 1;
+        } else {
+            // The last line has no newline to terminate in place, the mapping may end right after it
+            last.assign(p, end - p);
+            line = last.data();
+            len = last.size();
+            p = end;
+        }
+        lineno++;
+        int ret = line_(line, len);
+        if(status != nullptr) {
+            status->push_back(ret);
+        }
+        if(ret != QCLI_EOK) {
+            tprintln(" {}:{}: error {}", path, lineno, ret);
+            result = ret;
+            if(!keep_going) {
+                break;
+            }
+        }
+    }
+    unmap_file(data, size);
+    return result;
+}
+
+int QShell::line_(char *line, size_t len)
+{
+    if(len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    char *argv[QCLI_CMD_ARGC_MAX + 1];
+    int argc = 0;
+    int ret = QCLI_EOK;
+    {
+        Stage stage(this, QCLI_STAGE_PARSE);
+        ret = qcli_tokenize(line, len, argv, &argc);
+    }
+    if(ret == QCLI_ERR_PARAM || (ret == QCLI_EOK && argv[0][0] == '#')) {
+        return QCLI_EOK; // blank or comment
+    } else if(ret != QCLI_EOK) {
+        return ret;
+    }
+    return qcli_dispatch(&cli, argc, argv);
+}
+
+int QShell::source_cb_(int argc, char **argv)
+{
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    bool keep_going = argc > 1 && strcmp(argv[1], "-k") == 0;
+    int first = keep_going ? 2 : 1;
+    if(argc <= first) {
+        return QCLI_ERR_PARAM_LESS;
+    } else if(argc > first + 1) {
+        return QCLI_ERR_PARAM_MORE;
+    }
+    return self_->run_script(argv[first], keep_going);
+}
+
+// Splits "name=line", also "alias name=line", removing quotes around the line
+static bool alias_split(std::string_view def, std::string_view &name, std::string_view &line)
+{
+    auto trim = [](std::string_view v) {
+        size_t b = v.find_first_not_of(" \t\r");
+        size_t e = v.find_last_not_of(" \t\r");
+        return b == std::string_view::npos ? std::string_view() : v.substr(b, e - b + 1);
+    };
+    def = trim(def);
+    if(def.substr(0, 6) == "alias ") {
+        def = trim(def.substr(6));
+    }
+    size_t eq = def.find('=');
+    if(eq == std::string_view::npos) {
+        return false;
+    }
+    name = trim(def.substr(0, eq));
+    line = trim(def.substr(eq + 1));
+    if(line.size() >= 2 && (line[0] == '\'' || line[0] == '"') && line.back() == line[0]) {
+        line = trim(line.substr(1, line.size() - 2));
+    }
+    return !name.empty() && !line.empty();
+}
+
+int QShell::alias_add(const char *name, const char *line)
+{
+    if(name == nullptr || line == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    RegLock lock(this);
+    return alias_add_(name, line);
+}
+
+int QShell::alias_del(const char *name)
+{
+    if(name == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    RegLock lock(this);
+    return alias_del_(name);
+}
+
+int QShell::alias_load(const char *path)
+{
+    char *data = nullptr;
+    size_t size = 0;
+    if(path == nullptr || !map_file(path, data, size)) {
+        tprintln(" {}: cannot open", path != nullptr ? path : "");
+        return -1;
+    }
+    std::vector<std::pair<std::string_view, std::string_view>> defs;
+    std::vector<size_t> lines;
+    std::string_view text(data, size);
+    size_t lineno = 0;
+    for(size_t p = 0; p < text.size();) {
+        size_t e = std::min(text.find('\n', p), text.size());
+        std::string_view def = text.substr(p, e - p);
+        std::string_view name, line;
+        lineno++;
+        p = e + 1;
+        size_t b = def.find_first_not_of(" \t\r");
+        if(b == std::string_view::npos || def[b] == '#') {
+            continue;
+        }
+        if(!alias_split(def, name, line)) {
+            tprintln(" {}:{}: expected name=line", path, lineno);
+            continue;
+        }
+        defs.emplace_back(name, line);
+        lines.push_back(lineno);
+    }
+
+    int n = 0;
+    {
+        RegLock lock(this);
+        index_reserve_(cli.cmds_n + defs.size());
+        for(size_t i = 0; i < defs.size(); i++) {
+            int ret = alias_add_(defs[i].first, defs[i].second);
+            if(ret != QCLI_EOK) {
+                tprintln(" {}:{}: error {}", path, lines[i], ret);
+            } else {
+                n++;
+            }
+        }
+    }
+    unmap_file(data, size);
+    return n;
+}
+
+int QShell::alias_add_(std::string_view name, std::string_view line)
+{
+    if(name.empty() || name.find_first_of(" \t'$;&|") != std::string_view::npos || line.empty()) {
+        return QCLI_ERR_PARAM;
+    } else if(line.size() >= QCLI_CMD_STR_MAX) {
+        return QCLI_ERR_PARAM_MORE;
+    }
+    auto a = std::make_unique<Alias>();
+    a->name = name;
+    a->line = line;
+    a->desc = "alias: " + a->line;
+    QcliCmd *cmd = qcli_find(&cli, a->name.c_str());
+    if(cmd != nullptr && cmd->ncb != alias_run_) {
+        return QCLI_ERR_PARAM; // a command
+    }
+
+    // Argument references are found once, they are whole tokens such as $1
+    std::string tmp(line);
+    char *argv[QCLI_CMD_ARGC_MAX + 1];
+    int argc = 0;
+    int ret = qcli_tokenize(tmp.data(), tmp.size(), argv, &argc);
+    if(ret != QCLI_EOK) {
+        return ret;
+    }
+    for(int i = 0; i < argc; i++) {
+        if(argv[i][0] == '$' && argv[i][1] >= '1' && argv[i][1] <= '9' && argv[i][2] == '\0') {
+            a->params.emplace_back(i, argv[i][1] - '0');
+            a->nargs = std::max(a->nargs, argv[i][1] - '0');
+        }
+    }
+
+    alias_del_(name);
+    index_reserve_(cli.cmds_n + 1);
+    ret = qcli_node_add(&cli, a.get(), a->name.c_str(), alias_run_, a->desc.c_str());
+    if(ret != 0) {
+        return ret;
+    }
+    std::string key = a->name;
+    aliases.emplace(std::move(key), std::move(a));
+    return QCLI_EOK;
+}
+
+int QShell::alias_del_(std::string_view name)
+{
+    auto it = aliases.find(name);
+    if(it == aliases.end()) {
+        return QCLI_ERR_NOT_FOUND;
+    }
+    qcli_del(&cli, it->second->name.c_str());
+    retired.push_back({ epoch.load(), nullptr, {}, std::shared_ptr<Alias>(std::move(it->second)) });
+    retired_n++;
+    aliases.erase(it);
+    reclaim_();
+    return QCLI_EOK;
+}
+
+QShell::AliasBound *QShell::alias_bind_(Alias *a)
+{
+    RegLock lock(this);
+    AliasBound *old = a->bound.load();
+    if(old != nullptr && old->h.gen == std::atomic_ref<uint32_t>(cli.gen).load()) {
+        return old; // rebound by another thread
+    }
+    auto *b = new AliasBound;
+    qcli_compile(&cli, &b->h, a->line.c_str());
+    int depth = 0;
+    QcliCmd *cmd = qcli_resolve(&cli, b->h.argc, b->h.argv, &depth);
+    if(cmd != nullptr && cmd->table != nullptr) {
+        depth++;
+    }
+    b->dyn = std::any_of(a->params.begin(), a->params.end(), [&](auto &p) { return p.first < depth; });
+    a->bound.store(b);
+    if(old != nullptr) {
+        retired.push_back({ epoch.load(), nullptr, {}, std::shared_ptr<AliasBound>(old) });
+        retired_n++;
+    }
+    return b;
+}
+
+int QShell::alias_run_(QcliCmd *cmd, int argc, char **argv)
+{
+    static thread_local int nest = 0;
+    QShell *sh = self_;
+    if(sh == nullptr || nest >= ALIAS_NEST_MAX) {
+        return QCLI_ERR_PARAM;
+    }
+    Alias *a = static_cast<Alias *>(cmd);
+    if(argc - 1 < a->nargs) {
+        return QCLI_ERR_PARAM_LESS;
+    }
+    AliasBound *b = a->bound.load();
+    if(b == nullptr || b->h.gen != std::atomic_ref<uint32_t>(sh->cli.gen).load()) {
+        b = sh->alias_bind_(a);
+    }
+
+    // The expansion tokens are shared, only the pointer array is built per call
+    int n = b->h.argc + argc - 1 - a->nargs;
+    if(n > QCLI_CMD_ARGC_MAX) {
+        return QCLI_ERR_PARAM_MORE;
+    }
+    char *v[QCLI_CMD_ARGC_MAX + 1];
+    memcpy(v, b->h.argv, b->h.argc * sizeof(char *));
+    for(auto &[i, k] : a->params) {
+        v[i] = argv[k];
+    }
+    memcpy(v + b->h.argc, argv + 1 + a->nargs, (argc - 1 - a->nargs) * sizeof(char *));
+
+    nest++;
+    int ret = b->dyn ? qcli_dispatch(&sh->cli, n, v) : qcli_invoke_argv(&b->h, n, v);
+    nest--;
+    return ret;
+}
+
+int QShell::alias_cb_(int argc, char **argv)
+{
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    QShell *sh = self_;
+    std::vector<std::pair<std::string, std::string>> list;
+    std::string def;
+    for(int i = 1; i < argc; i++) {
+        def.append(i > 1 ? " " : "").append(argv[i]);
+    }
+    std::string_view name, line;
+    if(argc > 1 && alias_split(def, name, line)) {
+        RegLock lock(sh);
+        return sh->alias_add_(name, line);
+    } else if(def.find('=') != std::string::npos) {
+        return QCLI_ERR_PARAM;
+    }
+    {
+        RegLock lock(sh);
+        for(auto &[n, a] : sh->aliases) {
+            if(argc == 1 || n == def) {
+                list.emplace_back(n, a->line);
+            }
+        }
+    }
+    if(argc > 1 && list.empty()) {
+        return QCLI_ERR_PARAM_UNKNOWN;
+    }
+    int w = 0;
+    for(auto &e : list) {
+        w = std::max(w, (int)e.first.size());
+    }
+    for(auto &e : list) {
+        sh->print(" %-*s = %s\r\n", w, e.first.c_str(), e.second.c_str());
+    }
+    return QCLI_EOK;
+}
+
+int QShell::unalias_cb_(int argc, char **argv)
+{
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    if(argc < 2) {
+        return QCLI_ERR_PARAM_LESS;
+    } else if(argc > 2) {
+        return QCLI_ERR_PARAM_MORE;
+    }
+    return self_->alias_del(argv[1]) == QCLI_EOK ? QCLI_EOK : QCLI_ERR_PARAM_UNKNOWN;
+}
+
+int QShell::par(const std::vector<std::string> &lines, std::vector<int> *status)
+{
+    std::vector<ParJob> jobs(lines.size());
+    for(size_t i = 0; i < lines.size(); i++) {
+        ParJob &j = jobs[i];
+        j.line = lines[i];
+        j.argc = 0;
+        j.status = qcli_tokenize(j.line.data(), j.line.size(), j.argv, &j.argc);
+    }
+    return par_(jobs, status);
+}
+
+void QShell::par_threads(size_t n)
+{
+    {
+        std::lock_guard<std::mutex> lock(par_mtx);
+        par_n = n;
+    }
+    par_stop_();
+}
+
+int QShell::par_(std::vector<ParJob> &jobs, std::vector<int> *status)
+{
+    std::shared_ptr<ParPool> pool;
+    {
+        std::lock_guard<std::mutex> lock(par_mtx);
+        if(!workers) {
+            size_t n = par_n != 0 ? par_n : std::max(1u, std::thread::hardware_concurrency());
+            workers = std::make_shared<ParPool>();
+            for(size_t i = 0; i < n; i++) {
+                workers->threads.emplace_back(&QShell::par_worker_, this, std::ref(*workers));
+            }
+        }
+        pool = workers;
+    }
+
+    ParPool &p = *pool;
+    size_t left = 0;
+    {
+        std::lock_guard<std::mutex> lock(p.mtx);
+        for(auto &j : jobs) {
+            if(j.status == QCLI_EOK) {
+                j.left = &left;
+                left++;
+                p.jobs.push_back(&j);
+            }
+        }
+    }
+    p.job_cv.notify_all();
+
+    std::unique_lock<std::mutex> lock(p.mtx);
+    while(left > 0) {
+        if(p.jobs.empty()) {
+            p.done_cv.wait(lock);
+            continue;
+        }
+        ParJob *j = p.jobs.front();
+        p.jobs.pop_front();
+        lock.unlock();
+        par_run_(j);
+        lock.lock();
+        if(--*j->left == 0) {
+            p.done_cv.notify_all();
+        }
+    }
+    lock.unlock();
+
+    int result = QCLI_EOK;
+    if(status != nullptr) {
+        status->clear();
+    }
+    for(auto &j : jobs) {
+        write_(j.out.data(), j.out.size());
+        if(status != nullptr) {
+            status->push_back(j.status);
+        }
+        if(result == QCLI_EOK) {
+            result = j.status;
+        }
+    }
+    return result;
+}
+
+void QShell::par_run_(ParJob *job)
+{
+    Scope scope(this);
+    ReadGuard guard(this);
+    std::string *prev = capture_;
+    capture_ = &job->out;
+    job->status = qcli_dispatch(&cli, job->argc, job->argv);
+    capture_ = prev;
+}
+
+void QShell::par_worker_(ParPool &p)
+{
+    std::unique_lock<std::mutex> lock(p.mtx);
+    for(;;) {
+        p.job_cv.wait(lock, [&]() { return p.stop || !p.jobs.empty(); });
+        if(p.jobs.empty()) {
+            return;
+        }
+        ParJob *j = p.jobs.front();
+        p.jobs.pop_front();
+        lock.unlock();
+        par_run_(j);
+        lock.lock();
+        if(--*j->left == 0) {
+            p.done_cv.notify_all();
+        }
+    }
+}
+
+void QShell::par_stop_()
+{
+    std::shared_ptr<ParPool> p;
+    {
+        std::lock_guard<std::mutex> lock(par_mtx);
+        p.swap(workers);
+    }
+    if(!p) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(p->mtx);
+        p->stop = true;
+    }
+    p->job_cv.notify_all();
+    for(auto &t : p->threads) {
+        t.join();
+    }
+}
+
+int QShell::par_cb_(int argc, char **argv)
+{
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+
+    // Commands are split at ';' outside nested groups, && and || stay within a command
+    std::vector<ParJob> jobs;
+    if(argc == 2) {
+        // A quoted list is split as text, each command is tokenized on its own
+        std::vector<std::string> lines;
+        int depth = 0;
+        const char *start = argv[1];
+        for(const char *p = argv[1];; p++) {
+            if(*p == '{') {
+                depth++;
+            } else if(*p == '}' && depth > 0) {
+                depth--;
+            }
+            if(*p == '\0' || (*p == ';' && depth == 0)) {
+                std::string_view cmd(start, p - start);
+                if(cmd.find_first_not_of(' ') != std::string_view::npos) {
+                    lines.emplace_back(cmd);
+                }
+                if(*p == '\0') {
+                    break;
+                }
+                start = p + 1;
+            }
+        }
+        // Tokens point into the lines, so the jobs are not moved once tokenized
+        jobs.resize(lines.size());
+        for(size_t i = 0; i < lines.size(); i++) {
+            ParJob &j = jobs[i];
+            j.line = std::move(lines[i]);
+            j.argc = 0;
+            j.status = qcli_tokenize(j.line.data(), j.line.size(), j.argv, &j.argc);
+        }
+    } else if(argc >= 3 && strcmp(argv[1], "{") == 0 && strcmp(argv[argc - 1], "}") == 0) {
+        int depth = 0;
+        for(int i = 2, start = 2; i < argc; i++) {
+            bool last = i == argc - 1;
+            if(strcmp(argv[i], "{") == 0) {
+                depth++;
+            } else if(strcmp(argv[i], "}") == 0 && !last) {
+                depth--;
+            }
+            if(last || (depth == 0 && qcli_seq_op(argv[i]))) {
+                if(i > start) {
+                    ParJob &j = jobs.emplace_back();
+                    j.argc = i - start;
+                    j.status = QCLI_EOK;
+                    memcpy(j.argv, argv + start, j.argc * sizeof(char *));
+                }
+                start = i + 1;
+            }
+        }
+    } else {
+        return QCLI_ERR_PARAM;
+    }
+    if(jobs.empty()) {
+        return QCLI_ERR_PARAM_LESS;
+    }
+
+    std::vector<int> status;
+    int ret = self_->par_(jobs, &status);
+    for(size_t i = 0; i < status.size(); i++) {
+        if(status[i] != QCLI_EOK) {
+            self_->tprintln(" par[{}]: error {}", i + 1, status[i]);
+        }
+    }
+    return ret;
+}
+
+int QShell::cmd_cache(const char *path, uint32_t ttl_ms)
+{
+    if(path == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    RegLock lock(this);
+    QcliCmd *cmd = qcli_path_find(&cli, path);
+    if(cmd == nullptr) {
+        return QCLI_ERR_NOT_FOUND;
+    } else if(cmd->ncb != nullptr && cmd->ncb != cache_run_) {
+        return QCLI_ERR_PARAM; // an alias
+    }
+    {
+        std::lock_guard<std::mutex> clock(cache_mtx);
+        auto it = cache.find(cmd);
+        if(it == cache.end()) {
+            if(ttl_ms == 0) {
+                return QCLI_EOK;
+            }
+            it = cache.emplace(cmd, CacheEntry{ 0, 0, 0, {} }).first;
+        }
+        it->second.ttl = ttl_ms;
+        it->second.results.clear();
+    }
+    int ret = qcli_node_cb_set(cmd, ttl_ms != 0 ? cache_run_ : nullptr);
+    if(ret != QCLI_EOK) {
+        std::lock_guard<std::mutex> clock(cache_mtx);
+        cache.erase(cmd);
+    }
+    return ret;
+}
+
+void QShell::cache_clear(const char *path)
+{
+    RegLock lock(this);
+    const QcliCmd *cmd = path != nullptr ? qcli_path_find(&cli, path) : nullptr;
+    std::lock_guard<std::mutex> clock(cache_mtx);
+    for(auto &[c, e] : cache) {
+        if(path == nullptr || c == cmd) {
+            e.results.clear();
+        }
+    }
+}
+
+QShell::CacheStats QShell::cache_stats(const char *path)
+{
+    RegLock lock(this);
+    const QcliCmd *cmd = path != nullptr ? qcli_path_find(&cli, path) : nullptr;
+    CacheStats st{ 0, 0, 0 };
+    std::lock_guard<std::mutex> clock(cache_mtx);
+    for(auto &[c, e] : cache) {
+        if(path == nullptr || c == cmd) {
+            st.hits += e.hits;
+            st.misses += e.misses;
+            st.entries += e.results.size();
+        }
+    }
+    return st;
+}
+
+void QShell::cache_forget_(const QcliCmd *cmd)
+{
+    std::lock_guard<std::mutex> clock(cache_mtx);
+    for(auto it = cache.begin(); it != cache.end();) {
+        const QcliCmd *c = it->first;
+        while(c != nullptr && c != cmd) {
+            c = c->parent;
+        }
+        it = c != nullptr ? cache.erase(it) : std::next(it);
+    }
+}
+
+int QShell::cache_run_(QcliCmd *cmd, int argc, char **argv)
+{
+    QShell *sh = self_;
+    if(sh == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    QShellCmdHandler cb = std::atomic_ref<QShellCmdHandler>(cmd->cb).load();
+    std::string key;
+    for(int i = 0; i < argc; i++) {
+        key.append(argv[i]).push_back('\0');
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    std::shared_ptr<const std::string> hit;
+    uint32_t ttl = 0;
+    int status = QCLI_EOK;
+    {
+        // No entry once caching is turned off or the command deleted after this dispatch resolved it
+        std::lock_guard<std::mutex> lock(sh->cache_mtx);
+        auto e = sh->cache.find(cmd);
+        if(e != sh->cache.end()) {
+            auto r = e->second.results.find(key);
+            if(r != e->second.results.end() && r->second.expires > now) {
+                e->second.hits++;
+                hit = r->second.out;
+                status = r->second.status;
+            } else {
+                e->second.misses += e->second.ttl != 0;
+                ttl = e->second.ttl;
+            }
+        }
+    }
+    if(hit) {
+        sh->write_(hit->data(), hit->size());
+        return status;
+    } else if(ttl == 0) {
+        return cb(argc, argv);
+    }
+
+    auto out = std::make_shared<std::string>();
+    std::string *prev = capture_;
+    capture_ = out.get();
+    status = cb(argc, argv);
+    capture_ = prev;
+    {
+        std::lock_guard<std::mutex> lock(sh->cache_mtx);
+        auto e = sh->cache.find(cmd);
+        if(e != sh->cache.end() && e->second.ttl != 0) {
+            auto &results = e->second.results;
+            if(results.size() >= CACHE_KEYS_MAX && !results.contains(key)) {
+                std::erase_if(results, [&](auto &r) { return r.second.expires <= now; });
+            }
+            if(results.size() >= CACHE_KEYS_MAX && !results.contains(key)) {
+                // Nothing expired, the oldest result goes, all results of a command live equally long
+                results.erase(std::min_element(results.begin(), results.end(),
+                        [](auto &a, auto &b) { return a.second.expires < b.second.expires; }));
+            }
+            results[key] = CacheResult{ out, status, now + std::chrono::milliseconds(e->second.ttl) };
+        }
+    }
+    sh->write_(out->data(), out->size());
+    return status;
+}
+
+int QShell::cache_cb_(int argc, char **argv)
+{
+    (void)argv;
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    if(argc > 1) {
+        return QCLI_ERR_PARAM_UNKNOWN;
+    }
+    QShell *sh = self_;
+    struct Row {
+        std::string path;
+        uint32_t ttl;
+        uint64_t hits;
+        uint64_t misses;
+        size_t entries;
+    };
+    std::vector<Row> rows;
+    {
+        std::lock_guard<std::mutex> lock(sh->cache_mtx);
+        for(auto &[c, e] : sh->cache) {
+            if(e.ttl == 0) {
+                continue;
+            }
+            std::string path = c->name;
+            for(const QcliCmd *p = c->parent; p != nullptr; p = p->parent) {
+                path = std::string(p->name) + " " + path;
+            }
+            rows.push_back({ path, e.ttl, e.hits, e.misses, e.results.size() });
+        }
+    }
+    std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) { return a.path < b.path; });
+    int w = 4;
+    for(auto &r : rows) {
+        w = std::max(w, (int)r.path.size());
+    }
+    sh->print(" %-*s  %8s  %10s  %10s  %7s\r\n", w, "path", "ttl ms", "hits", "misses", "entries");
+    for(auto &r : rows) {
+        sh->print(" %-*s  %8u  %10llu  %10llu  %7zu\r\n", w, r.path.c_str(), r.ttl, (unsigned long long)r.hits,
+                (unsigned long long)r.misses, r.entries);
+    }
+    return QCLI_EOK;
+}
+
+int QShell::cache_clear_cb_(int argc, char **argv)
+{
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    std::string path;
+    for(int i = 2; i < argc; i++) {
+        path.append(i > 2 ? " " : "").append(argv[i]);
+    }
+    self_->cache_clear(argc > 2 ? path.c_str() : nullptr);
+    return QCLI_EOK;
+}
+
+#if QCLI_PROF
+void QShell::perf_span_(QcliStage stage, bool enter)
+{
+    if(enter) {
+        if(perf_depth > 0 && perf_depth <= PERF_DEPTH && perf_spans[perf_depth - 1].stage == stage) {
+            perf_spans[perf_depth - 1].nest++;
+            return;
+        }
+        if(perf_depth < PERF_DEPTH) {
+            perf_spans[perf_depth] = { stage, 0, perf_now(), 0 };
+        }
+        perf_depth++;
+        return;
+    }
+    if(perf_depth == 0) {
+        return;
+    } else if(perf_depth > PERF_DEPTH) {
+        perf_depth--;
+        return;
+    }
+    PerfSpan &span = perf_spans[perf_depth - 1];
+    if(span.nest > 0) {
+        span.nest--;
+        return;
+    }
+    uint64_t took = perf_now() - span.start;
+    uint64_t own = took > span.child ? took - span.child : 0;
+    perf_depth--;
+    if(perf_depth > 0 && perf_depth <= PERF_DEPTH) {
+        perf_spans[perf_depth - 1].child += took;
+    }
+
+    PerfStage &p = perf[span.stage];
+    p.count.fetch_add(1, std::memory_order_relaxed);
+    p.total.fetch_add(own, std::memory_order_relaxed);
+    uint64_t max = p.max.load(std::memory_order_relaxed);
+    while(own > max && !p.max.compare_exchange_weak(max, own, std::memory_order_relaxed)) {
+    }
+    int bucket = 0;
+    while(bucket < PERF_BUCKETS - 1 && (own >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+    p.hist[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void QShell::perf_hook_(Qcli *cli, QcliStage stage, int enter)
+{
+    (void)cli;
+    QShell *sh = self_ != nullptr ? self_ : default_;
+    if(sh != nullptr) {
+        sh->perf_span_(stage, enter != 0);
+    }
+}
+
+QShell::PerfStats QShell::perf_stats(QcliStage stage) const
+{
+    PerfStats st{};
+    if(stage < 0 || stage >= QCLI_STAGE_NUM) {
+        return st;
+    }
+    const PerfStage &p = perf[stage];
+    st.count = p.count.load(std::memory_order_relaxed);
+    st.total_ns = p.total.load(std::memory_order_relaxed);
+    st.max_ns = p.max.load(std::memory_order_relaxed);
+    for(int i = 0; i < PERF_BUCKETS; i++) {
+        st.hist[i] = p.hist[i].load(std::memory_order_relaxed);
+    }
+    return st;
+}
+
+void QShell::perf_reset()
+{
+    for(auto &p : perf) {
+        p.count.store(0, std::memory_order_relaxed);
+        p.total.store(0, std::memory_order_relaxed);
+        p.max.store(0, std::memory_order_relaxed);
+        for(auto &h : p.hist) {
+            h.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+// Short duration label such as "512ns", "2.0us" or "1.1s"
+static std::string perf_time(uint64_t ns)
+{
+    char buf[16];
+    if(ns < 1000) {
+        snprintf(buf, sizeof(buf), "%lluns", (unsigned long long)ns);
+    } else if(ns < 1000000) {
+        snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    } else if(ns < 1000000000) {
+        snprintf(buf, sizeof(buf), "%.1fms", ns / 1e6);
+    } else {
+        snprintf(buf, sizeof(buf), "%.1fs", ns / 1e9);
+    }
+    return buf;
+}
+
+int QShell::perf_cb_(int argc, char **argv)
+{
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    bool hist = argc > 1 && strcmp(argv[1], "-h") == 0;
+    if(argc > (hist ? 2 : 1)) {
+        return QCLI_ERR_PARAM_UNKNOWN;
+    }
+    QShell *sh = self_;
+    PerfStats st[QCLI_STAGE_NUM];
+    uint64_t all = 0;
+    for(int i = 0; i < QCLI_STAGE_NUM; i++) {
+        st[i] = sh->perf_stats((QcliStage)i);
+        all += st[i].total_ns;
+    }
+    sh->print(" %-8s  %10s  %10s  %6s  %8s  %8s\r\n", "stage", "count", "total ms", "share", "avg", "max");
+    for(int i = 0; i < QCLI_STAGE_NUM; i++) {
+        const PerfStats &s = st[i];
+        std::string avg = perf_time(s.count ? s.total_ns / s.count : 0);
+        sh->print(" %-8s  %10llu  %10.3f  %5.1f%%  %8s  %8s\r\n", PERF_STAGES[i], (unsigned long long)s.count,
+                s.total_ns / 1e6, all ? 100.0 * s.total_ns / all : 0.0, avg.c_str(), perf_time(s.max_ns).c_str());
+    }
+    if(!hist) {
+        return QCLI_EOK;
+    }
+    for(int i = 0; i < QCLI_STAGE_NUM; i++) {
+        const PerfStats &s = st[i];
+        // The counters are read one by one while stages run, a count may come without its bucket
+        int lo = 0;
+        int hi = PERF_BUCKETS - 1;
+        while(lo < PERF_BUCKETS && s.hist[lo] == 0) {
+            lo++;
+        }
+        if(lo == PERF_BUCKETS) {
+            continue;
+        }
+        while(s.hist[hi] == 0) {
+            hi--;
+        }
+        uint64_t peak = *std::max_element(s.hist.begin() + lo, s.hist.begin() + hi + 1);
+        sh->print("\r\n %s\r\n", PERF_STAGES[i]);
+        for(int b = lo; b <= hi; b++) {
+            int bar = (int)((s.hist[b] * 40 + peak - 1) / peak);
+            std::string label = b == PERF_BUCKETS - 1 ? ">= " + perf_time(1ull << b) : "< " + perf_time(2ull << b);
+            sh->print("  %9s  %-40.*s  %llu\r\n", label.c_str(), bar, "########################################",
+                    (unsigned long long)s.hist[b]);
+        }
+    }
+    return QCLI_EOK;
+}
+
+int QShell::perf_reset_cb_(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    self_->perf_reset();
+    return QCLI_EOK;
+}
+#endif
+
+bool QShell::piped() const
+{
+#ifdef _WIN32
+    return getch == nullptr && !_isatty(_fileno(stdin));
+#else
+    return getch == nullptr && !isatty(STDIN_FILENO);
+#endif
+}
+
+void QShell::exec_stream_()
+{
+    Scope scope(this);
+    // Output is collected like a capture and handed to the sink once per block
+    std::string *prev = capture_;
+    std::string pending;
+    auto flush = [&]() {
+        if(capture_ == &pending && !pending.empty()) {
+            capture_ = prev;
+            write_(pending.data(), pending.size());
+            capture_ = &pending;
+            pending.clear();
+        }
+    };
+    if(prev == nullptr) {
+        capture_ = &pending;
+    }
+
+    std::vector<char> buf(PIPE_BLOCK);
+    size_t have = 0;
+    size_t lineno = 0;
+    auto run = [&](char *line, size_t len) {
+        lineno++;
+        int ret = line_(line, len);
+        if(ret != QCLI_EOK) {
+            tprintln(" stdin:{}: error {}", lineno, ret);
+        }
+        if(pending.size() >= PIPE_BLOCK) {
+            flush();
+        }
+    };
+    while(!is_exit) {
+        watch_poll();
+        flush();
+        // Armed watches bound the wait for input to their next tick
+        if(wheel.count > 0 && !keyboard_wait(watch_timeout_())) {
+            continue;
+        }
+        if(have == buf.size()) {
+            buf.resize(buf.size() * 2); // a line longer than the buffer
+        }
+        ptrdiff_t n = 0;
+        {
+            Stage stage(this, QCLI_STAGE_READ);
+#ifdef _WIN32
+            n = _read(_fileno(stdin), buf.data() + have, (unsigned)std::min<size_t>(buf.size() - have, INT_MAX));
+#else
+            n = read(STDIN_FILENO, buf.data() + have, buf.size() - have);
+#endif
+        }
+        if(n <= 0) {
+            break;
+        }
+        char *p = buf.data();
+        char *end = p + have + n;
+        {
+            ReadGuard guard(this);
+            // After `frame` the input is binary frames, not lines, until a frame with len 0 leaves the mode
+            while(!is_exit && p < end) {
+                if(framed) {
+                    frame_feed_((uint8_t)*p++);
+                    continue;
+                }
+                char *nl = (char *)memchr(p, '\n', end - p);
+                if(nl == nullptr) {
+                    break;
+                }
+                run(p, nl - p);
+                p = nl + 1;
+            }
+        }
+        have = end - p;
+        memmove(buf.data(), p, have);
+        flush();
+    }
+    if(have > 0 && !is_exit) {
+        buf.resize(have + 1);
+        ReadGuard guard(this);
+        run(buf.data(), have);
+    }
+    flush();
+    capture_ = prev;
+}
+
+void QShell::exec(ExecMode mode)
+{
+    if(mode == ExecMode::Stream || (mode == ExecMode::Auto && piped())) {
+        exec_stream_();
+        if(on_exit) {
+            on_exit();
+        }
+        return;
+    }
+
+    Scope scope(this);
+    set_echo(false);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    while(!is_exit) {
+        watch_poll();
+        // Sleep in the key wait while watches are armed, a custom getch is expected to return promptly
+        if(getch == nullptr && !keyboard_wait(watch_timeout_())) {
+            continue;
+        }
+        int c = 0;
+        {
+            Stage stage(this, QCLI_STAGE_READ);
+            if(getch != nullptr) {
+                c = getch();
+            } else {
+                c = keyboard_getch();
+            }
+        }
+        // NUL and 0xff are frame bytes like any other, only EOF means no input
+        if(c == EOF || (c == 0 && !framed)) {
+            continue;
+        }
+        ReadGuard guard(this);
+        if(fg_key_()) {
+            continue;
+        }
+        if(framed) {
+            frame_feed_((uint8_t)c);
+            continue;
+        }
+        if(c == 3) { // ctrl+c
+            cli.print("\33[2K");
+            cli.print("\033[H\033[J");
+            cli.print("\r\n -QSH EXIT-\r\n");
+            break;
+        }
+
+#ifdef _WIN32
+        if(c == 0xe0) {
+            qcli_exec(&cli, c);
+            int next_c = 0;
+            if(getch != nullptr) {
+                next_c = getch();
+            } else {
+                next_c = keyboard_getch();
+            }
+            if(next_c != 0 && next_c != EOF) {
+                if(next_c == 3) {
+                    cli.print("\33[2K");
+                    cli.print("\033[H\033[J");
+                    cli.print(" \r\n#! QCLI Exit !\r\n");
+                    break;
+                }
+                qcli_exec(&cli, next_c);
+            }
+            continue;
+        } else {
+            qcli_exec(&cli, c);
+        }
+#else
+        if(c == 27) {
+            qcli_exec(&cli, c);
+            int next_c1 = keyboard_getch();
+            if(next_c1 != 0 && next_c1 != EOF) {
+                qcli_exec(&cli, next_c1);
+                if(next_c1 == 91) {
+                    int next_c2 = keyboard_getch();
+                    if(next_c2 != 0 && next_c2 != EOF) {
+                        qcli_exec(&cli, next_c2);
+                    }
+                }
+            }
+            continue;
+        } else {
+            qcli_exec(&cli, c);
+        }
+#endif
+        c = (c == 127) ? 8 : c;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    set_echo(true);
+
+    if(on_exit) {
+        on_exit();
+    }
+}
+
+int QShell::execc(char c)
+{
+    Scope scope(this);
+    ReadGuard guard(this);
+    if(fg_key_()) {
+        return 0;
+    }
+    if(framed) {
+        frame_feed_((uint8_t)c);
+    } else {
+        qcli_exec(&cli, c);
+    }
+    return 0;
+}
+
+int QShell::input_ring(size_t size)
+{
+    std::vector<uint8_t> buf(size);
+    if(qcli_ring_init(&ring, buf.data(), size) != 0) {
+        return -1;
+    }
+    ring_buf.swap(buf);
+    return 0;
+}
+
+int QShell::feed(char c)
+{
+    if(ring.buf == nullptr) {
+        return -1;
+    }
+    return qcli_ring_push(&ring, (uint8_t)c);
+}
+
+int QShell::poll(size_t budget)
+{
+    if(ring.buf == nullptr) {
+        return -1;
+    }
+    int n = 0;
+    uint8_t c;
+    while((budget == 0 || (size_t)n < budget) && qcli_ring_pop(&ring, &c) == 0) {
+        execc((char)c);
+        n++;
+    }
+    watch_poll();
+    return n;
+}
+
+int QShell::frame_mode(bool on)
+{
+    framed = on;
+    frame_rx.clear();
+    // No line feed or prompt after the command that switched, the host would read them before the first frame
+    cli.flags.is_echo = on;
+    return 0;
+}
+
+int QShell::frame_cb_(int argc, char **argv)
+{
+    (void)argv;
+    if(argc != 1 || self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    return self_->frame_mode(true);
+}
+
+void QShell::frame_feed_(uint8_t c)
+{
+    if(frame_rx.empty() && c != FRAME_SYNC) {
+        return; // resync on the next frame start
+    }
+    frame_rx.push_back((char)c);
+    if(frame_rx.size() < FRAME_HEAD) {
+        return;
+    }
+    size_t len = (uint8_t)frame_rx[1] | ((size_t)(uint8_t)frame_rx[2] << 8);
+    if(frame_rx.size() == FRAME_HEAD + len) {
+        frame_exec_();
+        frame_rx.clear();
+    }
+}
+
+void QShell::frame_exec_()
+{
+    size_t len = frame_rx.size() - FRAME_HEAD;
+    uint8_t seq = (uint8_t)frame_rx[3];
+    int status = QCLI_EOK;
+    bool leave = (len == 0);
+
+    frame_out.clear();
+    if(!leave) {
+        // Payload is NUL separated argv, the last argument may omit its terminator
+        frame_rx.push_back('\0');
+        char *argv[QCLI_CMD_ARGC_MAX + 1] = {};
+        int argc = 0;
+        char *p = frame_rx.data() + FRAME_HEAD;
+        char *end = p + len;
+        while(p < end) {
+            if(argc >= QCLI_CMD_ARGC_MAX) {
+                status = QCLI_ERR_PARAM_MORE;
+                break;
+            }
+            argv[argc++] = p;
+            p += strlen(p) + 1;
+        }
+        if(status == QCLI_EOK) {
+            std::string *prev = capture_;
+            capture_ = &frame_out;
+            status = qcli_dispatch(&cli, argc, argv);
+            capture_ = prev;
+        }
+    }
+
+    // The length field is 16 bits, longer output is cut and the status tells the host
+    size_t out_len = frame_out.size();
+    if(out_len > FRAME_OUT_MAX) {
+        out_len = FRAME_OUT_MAX;
+        status = QCLI_ERR_BUF;
+    }
+    char head[6] = { (char)FRAME_SYNC, (char)(out_len & 0xff), (char)(out_len >> 8), (char)seq,
+        (char)(status & 0xff), (char)((status >> 8) & 0xff) };
+    write_(head, 6);
+    write_(frame_out.data(), out_len);
+
+    if(leave) {
+        frame_mode(false);
+    }
+}
+
+QShell::TimerWheel::TimerWheel()
+{
+    for(auto &level : slot) {
+        for(auto &head : level) {
+            head.prev = head.next = &head;
+        }
+    }
+}
+
+void QShell::link_append_(WatchLink *list, WatchLink *node)
+{
+    node->prev = list->prev;
+    node->next = list;
+    list->prev->next = node;
+    list->prev = node;
+}
+
+void QShell::link_remove_(WatchLink *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+}
+
+void QShell::TimerWheel::insert(Watch *w)
+{
+    if(w->expires - now >= SPAN) {
+        w->expires = now + SPAN - 1;
+    }
+    uint64_t delta = w->expires - now;
+    unsigned level = 0;
+    while(level + 1 < LEVELS && delta >= ((uint64_t)1 << (BITS * (level + 1)))) {
+        level++;
+    }
+    link_append_(&slot[level][(w->expires >> (BITS * level)) & (SLOTS - 1)], w);
+    count++;
+}
+
+void QShell::TimerWheel::remove(Watch *w)
+{
+    link_remove_(w);
+    count--;
+}
+
+void QShell::TimerWheel::step(WatchLink *due)
+{
+    now++;
+    // Cascade: every level whose lower levels all wrapped redistributes its current slot
+    for(unsigned level = 1; level < LEVELS && (now & (((uint64_t)1 << (BITS * level)) - 1)) == 0; level++) {
+        WatchLink *head = &slot[level][(now >> (BITS * level)) & (SLOTS - 1)];
+        while(head->next != head) {
+            Watch *w = static_cast<Watch *>(head->next);
+            remove(w);
+            insert(w);
+        }
+    }
+    WatchLink *head = &slot[0][now & (SLOTS - 1)];
+    while(head->next != head) {
+        Watch *w = static_cast<Watch *>(head->next);
+        remove(w);
+        link_append_(due, w);
+    }
+}
+
+int QShell::watch_add(int argc, char **argv, uint32_t period_ms, bool redraw)
+{
+    if(argc <= 0 || argv == nullptr || period_ms == 0) {
+        return QCLI_ERR_PARAM;
+    } else if(argc > QCLI_CMD_ARGC_MAX) {
+        return QCLI_ERR_PARAM_MORE;
+    }
+    auto w = std::make_unique<Watch>();
+    for(int i = 0; i < argc; i++) {
+        w->toks.append(argv[i]).push_back('\0');
+        w->line.append(i > 0 ? " " : "").append(argv[i]);
+    }
+    char *p = w->toks.data();
+    for(int i = 0; i < argc; i++) {
+        w->argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    w->argc = argc;
+    return watch_arm_(std::move(w), period_ms, redraw);
+}
+
+int QShell::watch_add(const char *cmdline, uint32_t period_ms, bool redraw)
+{
+    if(cmdline == nullptr || period_ms == 0) {
+        return QCLI_ERR_PARAM;
+    }
+    auto w = std::make_unique<Watch>();
+    w->toks = cmdline;
+    w->argc = 0;
+    int ret = qcli_tokenize(w->toks.data(), w->toks.size(), w->argv, &w->argc);
+    if(ret != QCLI_EOK) {
+        return ret;
+    }
+    w->line = cmdline;
+    return watch_arm_(std::move(w), period_ms, redraw);
+}
+
+int QShell::watch_arm_(std::unique_ptr<Watch> w, uint32_t period_ms, bool redraw)
+{
+    // A sequence is resolved as it runs, like a compiled handle
+    bool seq = std::any_of(w->argv, w->argv + w->argc, qcli_seq_op);
+    if(!seq) {
+        ReadGuard guard(this);
+        if(qcli_resolve(&cli, w->argc, w->argv, nullptr) == nullptr) {
+            return QCLI_ERR_NOT_FOUND;
+        }
+    }
+    w->id = ++watch_seq;
+    w->period = std::max<uint32_t>(1, (period_ms + WATCH_TICK_MS - 1) / WATCH_TICK_MS);
+    w->redraw = redraw;
+    w->running = false;
+    w->dead = false;
+
+    // Catch the wheel up first so the first run is one tick away
+    if(wheel.count == 0) {
+        wheel.now = watch_ticks_();
+    }
+    w->expires = wheel.now + 1;
+    wheel.insert(w.get());
+    int id = w->id;
+    watches.emplace(id, std::move(w));
+    return id;
+}
+
+int QShell::watch_del(int id)
+{
+    auto it = watches.find(id);
+    if(it == watches.end()) {
+        return -1;
+    }
+    if(id == watch_fg) {
+        watch_fg = 0;
+    }
+    Watch *w = it->second.get();
+    if(w->running) {
+        w->dead = true; // released by watch_poll() once its run returns
+        return 0;
+    }
+    if(w->next != nullptr) {
+        if(w->expires > wheel.now) {
+            wheel.remove(w);
+        } else {
+            link_remove_(w); // on the due list of a watch_poll() in progress
+        }
+    }
+    watches.erase(it);
+    return 0;
+}
+
+uint64_t QShell::watch_ticks_() const
+{
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - wheel_epoch);
+    return (uint64_t)ms.count() / WATCH_TICK_MS;
+}
+
+int QShell::watch_timeout_() const
+{
+    if(wheel.count == 0) {
+        return -1;
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - wheel_epoch);
+    return (int)(WATCH_TICK_MS - (uint64_t)ms.count() % WATCH_TICK_MS);
+}
+
+int QShell::watch_poll()
+{
+    if(wheel.count == 0) {
+        return 0;
+    }
+    WatchLink due{ &due, &due };
+    uint64_t target = watch_ticks_();
+    while(wheel.now < target && wheel.count > 0) {
+        wheel.step(&due);
+    }
+    wheel.now = std::max(wheel.now, target);
+
+    int n = 0;
+    while(due.next != &due) {
+        Watch *w = static_cast<Watch *>(due.next);
+        link_remove_(w);
+        w->running = true;
+        watch_run_(*w);
+        w->running = false;
+        n++;
+        if(w->dead) {
+            watches.erase(w->id);
+            continue;
+        }
+        // A late poll runs a watch once, not once per missed period
+        w->expires = std::max(w->expires + w->period, wheel.now + 1);
+        wheel.insert(w);
+    }
+    return n;
+}
+
+void QShell::watch_run_(Watch &w)
+{
+    Scope scope(this);
+    ReadGuard guard(this);
+    // Dispatch may store into the argument array, the watch keeps its own
+    char *argv[QCLI_CMD_ARGC_MAX + 1];
+    memcpy(argv, w.argv, w.argc * sizeof(char *));
+    if(!w.redraw) {
+        qcli_dispatch(&cli, w.argc, argv);
+        return;
+    }
+
+    std::string *prev = capture_;
+    watch_out.clear();
+    capture_ = &watch_out;
+    int status = qcli_dispatch(&cli, w.argc, argv);
+    capture_ = prev;
+
+    // Repaint from the top left, clearing the tail of each line and everything below instead of the whole
+    // screen, so that unchanged lines do not flicker
+    char head[64];
+    int len = snprintf(head, sizeof(head), "\033[HEvery %ums: ", (unsigned)(w.period * WATCH_TICK_MS));
+    watch_frame.assign(head, len);
+    watch_frame.append(w.line).append("\033[K\r\n\033[K\r\n");
+    for(size_t i = 0; i < watch_out.size(); i++) {
+        char c = watch_out[i];
+        if(c == '\n' || (c == '\r' && i + 1 < watch_out.size() && watch_out[i + 1] == '\n')) {
+            watch_frame.append("\033[K");
+            if(c == '\r') {
+                watch_frame.push_back(watch_out[i++]);
+            }
+            c = '\n';
+        }
+        watch_frame.push_back(c);
+    }
+    if(status != QCLI_EOK) {
+        len = snprintf(head, sizeof(head), "\033[K\r\n #! status %d !", status);
+        watch_frame.append(head, len);
+    }
+    watch_frame.append("\033[J");
+    write_(watch_frame.data(), watch_frame.size());
+}
+
+bool QShell::fg_key_()
+{
+    bool stream_fg;
+    {
+        std::lock_guard<std::mutex> lock(var_mtx);
+        stream_fg = stream && stream->fg;
+    }
+    if(watch_fg == 0 && !stream_fg) {
+        return false;
+    }
+    if(watch_fg != 0) {
+        watch_del(watch_fg);
+    }
+    if(stream_fg) {
+        var_stream_stop();
+    }
+    // An empty line brings the prompt back below the last frame
+    qcli_exec(&cli, '\r');
+    return true;
+}
+
+int QShell::watch_cb_(int argc, char **argv)
+{
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    int first = 1;
+    uint32_t ms = 1000;
+    if(argc > 1 && strcmp(argv[1], "-n") == 0) {
+        if(argc < 3) {
+            return QCLI_ERR_PARAM_LESS;
+        }
+        auto r = std::from_chars(argv[2], argv[2] + strlen(argv[2]), ms);
+        if(r.ec != std::errc() || *r.ptr != '\0' || ms == 0) {
+            return QCLI_ERR_PARAM_TYPE;
+        }
+        first = 3;
+    }
+    if(argc <= first) {
+        return QCLI_ERR_PARAM_LESS;
+    }
+    if(strcmp(argv[first], argv[0]) == 0) {
+        return QCLI_ERR_PARAM; // a watch of watch would add a watch per run
+    }
+
+    QShell *sh = self_;
+    if(sh->watch_fg != 0) {
+        sh->watch_del(sh->watch_fg);
+    }
+    int id = sh->watch_add(argc - first, argv + first, ms, true);
+    if(id < 0) {
+        return id;
+    }
+    sh->watch_fg = id;
+    return QCLI_EOK;
+}
+
+std::vector<QShell::Var>::iterator QShell::var_find_(const char *name)
+{
+    auto it = std::lower_bound(vars.begin(), vars.end(), name,
+            [](const Var &v, const char *key) { return strcmp(v.name, key) < 0; });
+    return (it != vars.end() && strcmp(it->name, name) == 0) ? it : vars.end();
+}
+
+int QShell::var_add_(const char *name, const char *desc, void *ptr, const QShellVarOps *ops)
+{
+    if(name == nullptr || desc == nullptr || *name == '\0') {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(var_mtx);
+    auto it = std::lower_bound(vars.begin(), vars.end(), name,
+            [](const Var &v, const char *key) { return strcmp(v.name, key) < 0; });
+    if(it != vars.end() && strcmp(it->name, name) == 0) {
+        return -1;
+    }
+    vars.insert(it, { name, desc, ptr, ops });
     return 0;
 }
 
+int QShell::var_add_many(const QShellVarDesc *descs, size_t n)
+{
+    int added = 0;
+    for(size_t i = 0; i < n; i++) {
+        added += var_add_(descs[i].name, descs[i].desc, descs[i].ptr, descs[i].ops) == 0;
+    }
+    return added;
+}
+
+int QShell::var_del(const char *name)
+{
+    if(name == nullptr) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(var_mtx);
+    auto it = var_find_(name);
+    if(it == vars.end()) {
+        return -1;
+    }
+    // The stream thread holds a copy, it must not sample the variable once the caller may destroy it
+    void *ptr = it->ptr;
+    if(stream && std::any_of(stream->vars.begin(), stream->vars.end(), [&](const Var &v) { return v.ptr == ptr; })) {
+        var_stream_stop_();
+    }
+    vars.erase(it);
+    return 0;
+}
+
+int QShell::var_stream(int n, const char *const *names, uint32_t hz, bool binary)
+{
+    return var_stream_(n, names, hz, binary, false);
+}
+
+int QShell::var_stream_(int n, const char *const *names, uint32_t hz, bool binary, bool fg)
+{
+    if(n <= 0 || names == nullptr || hz == 0) {
+        return QCLI_ERR_PARAM;
+    }
+    std::lock_guard<std::mutex> lock(var_mtx);
+    var_stream_stop_();
+
+    auto st = std::make_unique<VarStream>();
+    for(int i = 0; i < n; i++) {
+        auto it = var_find_(names[i]);
+        if(it == vars.end()) {
+            return QCLI_ERR_PARAM_UNKNOWN;
+        }
+        st->vars.push_back(*it);
+    }
+    st->hz = hz;
+    st->binary = binary;
+    st->fg = fg;
+    st->thr = std::thread(&QShell::var_stream_run_, this, std::ref(*st));
+    stream = std::move(st);
+    return QCLI_EOK;
+}
+
+void QShell::var_stream_stop()
+{
+    std::lock_guard<std::mutex> lock(var_mtx);
+    var_stream_stop_();
+}
+
+void QShell::var_stream_stop_()
+{
+    if(!stream) {
+        return;
+    }
+    stream->stop.store(true, std::memory_order_relaxed);
+    stream->thr.join();
+    stream.reset();
+}
+
+void QShell::var_stream_run_(VarStream &st)
+{
+    std::string head = st.binary ? "# stream" : "";
+    for(size_t i = 0; i < st.vars.size(); i++) {
+        if(st.binary) {
+            head.append(" ").append(st.vars[i].name).append(":").append(st.vars[i].ops->type);
+        } else {
+            head.append(i > 0 ? "," : "").append(st.vars[i].name);
+        }
+    }
+    head.append("\r\n");
+    write_(head.data(), head.size());
+
+    // Samples only load the atomics and append to the batch, output is written once per batch
+    uint32_t batch_n = std::clamp<uint32_t>(st.hz / 50, 1, 0xffff);
+    std::string batch;
+    uint32_t count = 0;
+    char val[64];
+    auto period = std::chrono::nanoseconds(1000000000ull / st.hz);
+    auto next = std::chrono::steady_clock::now();
+    while(!st.stop.load(std::memory_order_relaxed)) {
+        if(count == 0 && st.binary) {
+            batch.assign(3, '\0');
+        }
+        for(size_t i = 0; i < st.vars.size(); i++) {
+            const Var &v = st.vars[i];
+            if(st.binary) {
+                v.ops->raw(v.ptr, val);
+                batch.append(val, v.ops->size);
+            } else {
+                if(i > 0) {
+                    batch.push_back(',');
+                }
+                batch.append(val, v.ops->get(v.ptr, val, sizeof(val)));
+            }
+        }
+        if(!st.binary) {
+            batch.append("\r\n");
+        }
+        if(++count == batch_n) {
+            if(st.binary) {
+                batch[0] = (char)STREAM_SYNC;
+                batch[1] = (char)(count & 0xff);
+                batch[2] = (char)(count >> 8);
+            }
+            write_(batch.data(), batch.size());
+            batch.clear();
+            count = 0;
+        }
+
+        next += period;
+        auto now = std::chrono::steady_clock::now();
+        if(now - next > std::chrono::milliseconds(100)) {
+            next = now; // fell far behind, resume from now instead of bursting
+        }
+        std::this_thread::sleep_until(next);
+    }
+}
+
+int QShell::var_cb_(int argc, char **argv)
+{
+    if(argc > 1) {
+        return QCLI_ERR_PARAM_UNKNOWN;
+    }
+    return var_list_cb_(argc, argv);
+}
+
+int QShell::var_list_cb_(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    std::lock_guard<std::mutex> lock(self_->var_mtx);
+    int w = 0;
+    for(auto &v : self_->vars) {
+        w = std::max(w, (int)strlen(v.name));
+    }
+    char val[64];
+    for(auto &v : self_->vars) {
+        size_t n = v.ops->get(v.ptr, val, sizeof(val));
+        self_->print(" %-*s  %-4s  %-12.*s  %s\r\n", w, v.name, v.ops->type, (int)n, val, v.desc);
+    }
+    return QCLI_EOK;
+}
+
+int QShell::var_get_cb_(int argc, char **argv)
+{
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    if(argc < 3) {
+        return QCLI_ERR_PARAM_LESS;
+    }
+    std::lock_guard<std::mutex> lock(self_->var_mtx);
+    char val[64];
+    for(int i = 2; i < argc; i++) {
+        auto it = self_->var_find_(argv[i]);
+        if(it == self_->vars.end()) {
+            return QCLI_ERR_PARAM_UNKNOWN;
+        }
+        size_t n = it->ops->get(it->ptr, val, sizeof(val));
+        self_->print(" %s = %.*s\r\n", it->name, (int)n, val);
+    }
+    return QCLI_EOK;
+}
+
+int QShell::var_set_cb_(int argc, char **argv)
+{
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    if(argc < 4) {
+        return QCLI_ERR_PARAM_LESS;
+    } else if(argc > 4) {
+        return QCLI_ERR_PARAM_MORE;
+    }
+    std::lock_guard<std::mutex> lock(self_->var_mtx);
+    auto it = self_->var_find_(argv[2]);
+    if(it == self_->vars.end()) {
+        return QCLI_ERR_PARAM_UNKNOWN;
+    }
+    return it->ops->set(it->ptr, argv[3]) ? QCLI_EOK : QCLI_ERR_PARAM_TYPE;
+}
+
+int QShell::var_stream_cb_(int argc, char **argv)
+{
+    if(self_ == nullptr) {
+        return QCLI_ERR_PARAM;
+    }
+    int first = 2;
+    bool binary = argc > 2 && strcmp(argv[2], "-b") == 0;
+    if(binary) {
+        first++;
+    }
+    if(argc - first < 2) {
+        return QCLI_ERR_PARAM_LESS;
+    }
+    uint32_t hz = 0;
+    if(!QShellArg<uint32_t>::parse(argv[argc - 1], hz) || hz == 0) {
+        return QCLI_ERR_PARAM_TYPE;
+    }
+    return self_->var_stream_(argc - 1 - first, argv + first, hz, binary, true);
+}
+
 int QShell::args_help(ArgsTable *table, size_t sz)
 {
     size_t n = sz / sizeof(ArgsTable);
@@ -12,12 +12,27 @@
 #pragma once
 
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <string>
 #include <vector>
 #include <cstring>
+#include <chrono>
+#include <unordered_map>
 #include <functional>
+#include <array>
+#include <deque>
+#include <map>
+#include <memory>
+#include <charconv>
+#include <limits>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
 #define QCLI_USE_STDLIBC
 #include "qcli.h"
@@ -28,10 +43,288 @@
 
 #define ISARGC(n) (argc == n)
 
+// Typed argument parser, specialize it to bind custom types (e.g. named enums)
+// parse() returns false if the whole string is not a valid T
+template<typename T>
+struct QShellArg;
+
+template<typename T>
+    requires std::is_integral_v<T> && (!std::is_same_v<T, bool>)
+struct QShellArg<T> {
+    static bool parse(const char *s, T &v)
+    {
+        std::string_view sv(s);
+        bool neg = !sv.empty() && sv.front() == '-';
+        if(neg) {
+            if constexpr(std::is_unsigned_v<T>) {
+                return false;
+            }
+            sv.remove_prefix(1);
+        }
+        int base = 10;
+        if(sv.size() > 2 && sv[0] == '0' && (sv[1] == 'x' || sv[1] == 'X')) {
+            base = 16;
+            sv.remove_prefix(2);
+        }
+        std::make_unsigned_t<T> u = 0;
+        auto [end, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), u, base);
+        if(ec != std::errc() || end != sv.data() + sv.size() || sv.empty()) {
+            return false;
+        }
+        if constexpr(std::is_signed_v<T>) {
+            using U = std::make_unsigned_t<T>;
+            if(u > (U)std::numeric_limits<T>::max() + (neg ? 1u : 0u)) {
+                return false;
+            }
+            v = neg ? (T)(0 - u) : (T)u;
+        } else {
+            v = u;
+        }
+        return true;
+    }
+};
+
+template<typename T>
+    requires std::is_floating_point_v<T>
+struct QShellArg<T> {
+    static bool parse(const char *s, T &v)
+    {
+        const char *end = s + strlen(s);
+        auto [p, ec] = std::from_chars(s, end, v);
+        return ec == std::errc() && p == end && p != s;
+    }
+};
+
+template<typename T>
+    requires std::is_enum_v<T>
+struct QShellArg<T> {
+    static bool parse(const char *s, T &v)
+    {
+        std::underlying_type_t<T> u;
+        if(!QShellArg<std::underlying_type_t<T>>::parse(s, u)) {
+            return false;
+        }
+        v = (T)u;
+        return true;
+    }
+};
+
+template<>
+struct QShellArg<bool> {
+    static bool parse(const char *s, bool &v)
+    {
+        if(ISARG(s, "1") || ISARG(s, "true") || ISARG(s, "on")) {
+            v = true;
+        } else if(ISARG(s, "0") || ISARG(s, "false") || ISARG(s, "off")) {
+            v = false;
+        } else {
+            return false;
+        }
+        return true;
+    }
+};
+
+template<>
+struct QShellArg<std::string_view> {
+    static bool parse(const char *s, std::string_view &v)
+    {
+        v = s;
+        return true;
+    }
+};
+
+template<>
+struct QShellArg<const char *> {
+    static bool parse(const char *s, const char *&v)
+    {
+        v = s;
+        return true;
+    }
+};
+
+// Signature traits of a typed handler, the argument list is used to generate its parser
+template<typename Sig>
+struct QShellSig;
+
+template<typename R, typename... A>
+struct QShellSig<R (*)(A...)> {
+    using Ret = R;
+    using Args = std::tuple<std::remove_cvref_t<A>...>;
+};
+
+template<typename R, typename C, typename... A>
+struct QShellSig<R (C::*)(A...) const> : QShellSig<R (*)(A...)> {};
+
+// Wraps a function pointer as a stateless callable, so both forms share one trampoline
+template<auto Fn>
+struct QShellFn {
+    template<typename... A>
+    decltype(auto) operator()(A &&...a) const
+    {
+        return Fn(std::forward<A>(a)...);
+    }
+};
+
+// Stateless callable taking typed arguments instead of argc/argv
+template<typename F, typename Handler>
+concept QShellTypedFn = std::is_class_v<F> && std::is_empty_v<F> && std::is_default_constructible_v<F> &&
+                        !std::is_convertible_v<F, Handler> && requires { &F::operator(); };
+
+// Argument kinds accepted by the typed print path
+enum class QShellFmtKind : uint8_t { None, Bool, Char, Int, Float, Str };
+
+template<typename T>
+consteval QShellFmtKind qshell_fmt_kind()
+{
+    using U = std::remove_cvref_t<T>;
+    if constexpr(std::is_same_v<U, bool>) {
+        return QShellFmtKind::Bool;
+    } else if constexpr(std::is_same_v<U, char>) {
+        return QShellFmtKind::Char;
+    } else if constexpr(std::is_integral_v<U> || std::is_enum_v<U>) {
+        return QShellFmtKind::Int;
+    } else if constexpr(std::is_floating_point_v<U>) {
+        return QShellFmtKind::Float;
+    } else if constexpr(std::is_convertible_v<U, std::string_view> || std::is_convertible_v<U, const char *>) {
+        return QShellFmtKind::Str;
+    } else {
+        return QShellFmtKind::None;
+    }
+}
+
+// Format string checked at compile time against the argument types
+// Placeholders: {} any argument, {:x} hex integer, {:.N} float with N decimals (at most QSHELL_FMT_PREC_MAX),
+// {{ and }} escape braces. Floats too large for N decimals in fixed notation are printed in scientific notation.
+inline constexpr int QSHELL_FMT_PREC_MAX = 64;
+
+template<typename... Args>
+class QShellFmt {
+public:
+    struct Field {
+        uint16_t begin; // offset of '{'
+        uint16_t end;   // offset after '}'
+        char spec;      // 0, 'x' or '.'
+        uint8_t prec;
+    };
+
+    template<typename S>
+        requires std::is_convertible_v<const S &, std::string_view>
+    consteval QShellFmt(const S &s) : str(s)
+    {
+        constexpr QShellFmtKind kinds[] = { qshell_fmt_kind<Args>()..., QShellFmtKind::None };
+        size_t n = 0;
+        for(size_t i = 0; i < str.size(); i++) {
+            char c = str[i];
+            if(c == '}') {
+                if(i + 1 >= str.size() || str[i + 1] != '}') {
+                    bad_format_("unmatched '}'");
+                }
+                escaped = true;
+                i++;
+                continue;
+            }
+            if(c != '{') {
+                continue;
+            }
+            if(i + 1 < str.size() && str[i + 1] == '{') {
+                escaped = true;
+                i++;
+                continue;
+            }
+            if(n >= sizeof...(Args)) {
+                bad_format_("more placeholders than arguments");
+            }
+            Field f{ (uint16_t)i, 0, 0, 0 };
+            size_t j = i + 1;
+            if(j < str.size() && str[j] == ':') {
+                j++;
+                if(j < str.size() && str[j] == 'x') {
+                    if(kinds[n] != QShellFmtKind::Int) {
+                        bad_format_("{:x} needs an integer argument");
+                    }
+                    f.spec = 'x';
+                    j++;
+                } else if(j < str.size() && str[j] == '.') {
+                    if(kinds[n] != QShellFmtKind::Float) {
+                        bad_format_("{:.N} needs a floating point argument");
+                    }
+                    f.spec = '.';
+                    j++;
+                    int prec = 0;
+                    while(j < str.size() && str[j] >= '0' && str[j] <= '9') {
+                        prec = prec * 10 + (str[j++] - '0');
+                        if(prec > QSHELL_FMT_PREC_MAX) {
+                            bad_format_("{:.N} precision over QSHELL_FMT_PREC_MAX");
+                        }
+                    }
+                    f.prec = (uint8_t)prec;
+                } else {
+                    bad_format_("unknown format spec");
+                }
+            }
+            if(j >= str.size() || str[j] != '}') {
+                bad_format_("unterminated placeholder");
+            }
+            if(kinds[n] == QShellFmtKind::None) {
+                bad_format_("argument type cannot be printed");
+            }
+            f.end = (uint16_t)(j + 1);
+            fields[n++] = f;
+            i = j;
+        }
+        if(n != sizeof...(Args)) {
+            bad_format_("fewer placeholders than arguments");
+        }
+    }
+
+    std::string_view str;
+    std::array<Field, sizeof...(Args)> fields{};
+    bool escaped{ false }; // literal text contains {{ or }}
+
+private:
+    // Not constexpr: reaching it during constant evaluation fails the build with this call in the message
+    static void bad_format_(const char *) {}
+};
+
+// Registered variable types, the name is shown by `var list` and in stream headers
+template<typename T>
+consteval const char *qshell_var_type()
+{
+    if constexpr(std::is_same_v<T, bool>) {
+        return "bool";
+    } else if constexpr(std::is_floating_point_v<T>) {
+        return sizeof(T) == 4 ? "f32" : "f64";
+    } else if constexpr(std::is_signed_v<T>) {
+        return sizeof(T) == 1 ? "i8" : sizeof(T) == 2 ? "i16" : sizeof(T) == 4 ? "i32" : "i64";
+    } else {
+        return sizeof(T) == 1 ? "u8" : sizeof(T) == 2 ? "u16" : sizeof(T) == 4 ? "u32" : "u64";
+    }
+}
+
+// Type erased access to an std::atomic<T> variable, one table per type
+struct QShellVarOps {
+    const char *type;
+    size_t size;
+    // Formats the value as text, returns its length
+    size_t (*get)(const void *var, char *buf, size_t n);
+    bool (*set)(void *var, const char *str);
+    // Copies the value in native byte order, `size` bytes
+    void (*raw)(const void *var, char *out);
+};
+
+// A variable registration built at compile time, see QShell::var_desc()
+struct QShellVarDesc {
+    const char *name;
+    const char *desc;
+    void *ptr;
+    const QShellVarOps *ops;
+};
+
 class QShell {
 public:
     // Constructor for QShell, initializes the shell with a print function and a get character function
     using ArgsTable = QcliTable;
+    // Returns the next input byte as 0..255, or EOF when there is none. 0 is only taken as input in framed mode.
     typedef int (*GetChFunc)(void);
     using Hook = std::function<void()>;
     QShell(QcliPrint print, GetChFunc getch);
@@ -52,12 +345,58 @@ public:
     // Adds a command to the shell with its handler and desc description
     int cmd_add(const char *name, QShellCmdHandler handler, const char *desc);
 
+    // Adds a command whose handler takes typed arguments, e.g. [](int id, float val) { ... }
+    // Arguments are converted by QShellArg<T>, arity and type errors return QCLI_ERR_PARAM_LESS/MORE/TYPE
+    template<typename F>
+        requires QShellTypedFn<F, QShellCmdHandler>
+    int cmd_add(const char *name, F, const char *desc)
+    {
+        return cmd_add(name, typed_cb_<F, typename QShellSig<decltype(&F::operator())>::Args, 1>, desc);
+    }
+
+    // Adds a command bound to a typed function, e.g. cmd_add<&speed_set>("speed", "set speed")
+    template<auto Fn>
+    int cmd_add(const char *name, const char *desc)
+    {
+        return cmd_add(name, typed_cb_<QShellFn<Fn>, typename QShellSig<decltype(Fn)>::Args, 1>, desc);
+    }
+
+    // Adds commands and subcommands in one sorted pass, see qcli_add_bulk()
+    // descs is reordered, returns the number of commands added
+    int cmd_add_many(QcliDesc *descs, size_t n);
+
+    // Same with nodes provided by the caller, e.g. in static storage, cmds[i] is used for descs[i] after sorting
+    // The nodes must outlive their commands, the shell never frees them
+    int cmd_add_many(QcliDesc *descs, QcliCmd *cmds, size_t n);
+
     // Deletes a command from the shell by its name
+    // Commands can be added and deleted from any thread while the shell dispatches, a deleted command is
+    // returned to the pool once no dispatch that may still use it is running
     int cmd_del(const char *name);
 
-    // Adds a subcommand to a parent command
+    // Adds a subcommand to a parent command, parent_name is a command path such as "net if"
     int cmd_sub_add(const char *parent_name, const char *subcmd_name, QShellCmdHandler handler, const char *desc);
 
+    // Adds a subcommand whose handler takes typed arguments
+    template<typename F>
+        requires QShellTypedFn<F, QShellCmdHandler>
+    int cmd_sub_add(const char *parent_name, const char *subcmd_name, F, const char *desc)
+    {
+        return cmd_sub_add(parent_name, subcmd_name,
+                typed_sub_cb_<F, typename QShellSig<decltype(&F::operator())>::Args>(parent_name), desc);
+    }
+
+    template<auto Fn>
+    int cmd_sub_add(const char *parent_name, const char *subcmd_name, const char *desc)
+    {
+        return cmd_sub_add(parent_name, subcmd_name,
+                typed_sub_cb_<QShellFn<Fn>, typename QShellSig<decltype(Fn)>::Args>(parent_name), desc);
+    }
+
+    // Binds an argument table to a command path, keys are dispatched, completed and listed by the core
+    // The table is sorted in place and must outlive the command
+    int cmd_table_set(const char *name, ArgsTable *table, size_t table_size);
+
     // Stops the shell thread
     int exit();
 
@@ -75,15 +414,791 @@ public:
 
     int print(const char *fmt, ...);
 
-    int xstr(std::string str);
+    // Typed print, the format is checked at compile time and arguments are written directly to the
+    // output without vsnprintf, e.g. tprint("speed {} rpm, load {:.2}\r\n", rpm, load)
+    template<typename... Args>
+    int tprint(QShellFmt<std::type_identity_t<Args>...> fmt, const Args &...args)
+    {
+        OutWriter w(*this);
+        fmt_write_(w, fmt, args...);
+        return (int)w.flush();
+    }
+
+    template<typename... Args>
+    int tprintln(QShellFmt<std::type_identity_t<Args>...> fmt, const Args &...args)
+    {
+        OutWriter w(*this);
+        fmt_write_(w, fmt, args...);
+        w.put("\r\n", 2);
+        return (int)w.flush();
+    }
+
+    // Caches the text of `?` and `? -l`, `size` bytes each, 0 disables the cache
+    // Help longer than the cache is printed directly, init() sets up 16 KiB
+    int help_cache(size_t size);
+
+    // Runs a command line without echo, history or prompt, returns the callback result
+    int xstr(const std::string &str);
+
+    // Runs a command line like xstr() with the output of this thread going to `out` instead of the sink.
+    // out is cleared first and keeps its capacity, so a buffer reused across calls stops allocating.
+    // Callbacks must print through the shell (print, tprint, DBG_PRINT), not stdio. Captures nest.
+    int capture(const std::string &cmdline, std::string &out);
 
-    void exec();
+    // Precompiled command line for commands issued repeatedly, see qcli_compile()
+    using CmdHandle = QcliHandle;
+
+    int compile(CmdHandle &h, const char *cmdline);
+
+    // Runs a compiled command, no parsing or lookup unless commands were added or deleted since
+    int invoke(CmdHandle &h);
+
+    // Compiled script, commands are resolved to handles once so that loops only pay for the callbacks
+    //   repeat N { ... }            for i in a..b { ... }       (bounds inclusive)
+    //   if x op y { ... } [} else {  ...] }                     (op: == != < > <= >=, integer or text)
+    //   set name value              exit [status]               # comment
+    // An argument $name is replaced by the value of the variable, $? is the status of the last command.
+    // Blocks open with '{' at the end of a line and close with '}' on a line of its own. Lines are not limited to
+    // QCLI_CMD_STR_MAX. Scripts are run through this API, the `source` built-in runs plain command files.
+    class Script {
+    public:
+        // Returns 0, or QCLI_ERR_PARAM with error() set to "line N: reason"
+        int compile(QShell &sh, std::string_view src);
+
+        // Returns the status of the last command, or the exit status
+        int run();
+
+        const std::string &error() const { return err; }
+
+    private:
+        struct Arg {
+            std::string text;
+            int slot{ -1 }; // variable, or -1 for text
+        };
+
+        enum class Op : uint8_t { Cmd, Dyn, Repeat, For, If, Set, Exit };
+
+        struct Node {
+            Op op;
+            int line;
+            std::unique_ptr<CmdHandle> h;            // Cmd: compiled command, pinned as it points into itself
+            std::unique_ptr<char[]> toks;            // Cmd: token storage the handle points into
+            std::vector<std::pair<int, int>> subst; // Cmd: argv index patched with a variable slot
+            std::vector<Arg> args;                  // Dyn tokens, loop bounds, if/set/exit operands
+            int var{ -1 };                          // For/Set target
+            std::string cmp;                        // If operator
+            std::vector<Node> body;
+            std::vector<Node> other;                // else branch
+        };
+
+        // Parses lines up to the '}' closing the current block, returns 1 for '}', 2 for '} else {', 0 at the end
+        int parse_(const std::vector<std::string_view> &lines, size_t &i, std::vector<Node> &out);
+        int node_(const std::vector<std::string_view> &toks, std::string_view text, Node &n);
+        int slot_(std::string_view name);
+        Arg arg_(std::string_view tok);
+        const std::string &val_(const Arg &a);
+        bool int_(const Arg &a, int64_t &v);
+        int exec_(std::vector<Node> &nodes);
+        int dyn_(Node &n);
+        int fail_(int line, const char *msg);
+
+        QShell *sh{ nullptr };
+        std::vector<Node> prog;
+        std::vector<std::string> names; // slot 0 is "?"
+        std::vector<std::string> vals;
+        int status{ 0 };
+        bool status_dirty{ false };
+        bool stop{ false };
+        std::string err;
+    };
+
+    // Compiles and runs a script once, returns its status
+    int script(std::string_view src);
+
+    // Runs a command file line by line without echo or history, lines are tokenized in place in a private mapping
+    // of the file so they are not limited to QCLI_CMD_STR_MAX. Blank lines and '#' comments are skipped. Failing
+    // lines are reported as "path:line: error N". Stops at the first failure unless keep_going is set.
+    // status, if given, receives the result of every line. Returns 0 or the result of the last failing line.
+    int run_script(const char *path, bool keep_going = false, std::vector<int> *status = nullptr);
+
+    // Defines a command that runs `line` instead, with $1..$9 tokens replaced by its arguments and the remaining
+    // arguments appended, e.g. alias_add("up", "net if $1 up"). The expansion is tokenized and resolved once, and
+    // again only after the command tree changed. Aliases are listed in help and completed like commands.
+    // An alias replaces an alias of the same name but not a command.
+    int alias_add(const char *name, const char *line);
+
+    int alias_del(const char *name);
+
+    // Loads "name=line" definitions, one per line, blank lines and '#' comments are skipped. Expansions are only
+    // resolved on first use. Returns the number of aliases defined, or -1 if the file cannot be read.
+    int alias_load(const char *path);
+
+    // Runs command lines concurrently on a worker pool, each with its own output buffer, the outputs are written
+    // in submission order once all are done. Lines may be sequences and are not limited to QCLI_CMD_STR_MAX.
+    // status, if given, receives the result of each line. Returns the first failure in submission order, or 0.
+    // Also the `par 'a x ; b y ; c z'` built-in, the quoted list is split at ';' and each command gets
+    // QCLI_CMD_ARGC_MAX tokens. Typed lines stay within QCLI_CMD_STR_MAX characters.
+    int par(const std::vector<std::string> &lines, std::vector<int> *status = nullptr);
+
+    // Worker threads of par(), 0 for one per hardware thread. The pool is started on first use.
+    void par_threads(size_t n);
+
+    // Memoizes the output and status of a command for ttl_ms, keyed by its full argv. Hits replay the output
+    // without calling the callback, 0 turns caching off. path is a command path such as "net stat", argument
+    // table entries, aliases and the core built-ins are not cached. Also the `cache` built-in.
+    int cmd_cache(const char *path, uint32_t ttl_ms);
+
+    // Drops the cached results of a command, or of all commands
+    void cache_clear(const char *path = nullptr);
+
+    struct CacheStats {
+        uint64_t hits;
+        uint64_t misses;
+        size_t entries;
+    };
+
+    // Counters of a command, or summed over all cached commands
+    CacheStats cache_stats(const char *path = nullptr);
+
+#if QCLI_PROF
+    static constexpr int PERF_BUCKETS = 32;
+
+    // Time spent in one stage of input handling, in steady_clock nanoseconds. A stage only counts its own time,
+    // e.g. output printed by a callback is charged to QCLI_STAGE_OUTPUT. hist[i] counts spans of 2^i to
+    // 2^(i+1) ns, the last bucket also takes longer ones.
+    struct PerfStats {
+        uint64_t count;
+        uint64_t total_ns;
+        uint64_t max_ns;
+        std::array<uint64_t, PERF_BUCKETS> hist;
+    };
+
+    // Profile of a stage since init or the last perf_reset(). Only built with QCLI_PROF, like the `perf`
+    // built-in: `perf [-h]` shows the breakdown, with histograms for -h, `perf reset` clears it.
+    PerfStats perf_stats(QcliStage stage) const;
+
+    void perf_reset();
+#endif
+
+    // How exec() reads its input. Stream reads stdin in blocks and dispatches whole lines without echo, prompt
+    // or line editing, output is buffered per block and failing lines are reported as "stdin:line: error N".
+    // Auto streams when stdin is not a terminal and no getch function is set. Watches run between blocks while
+    // the input is open, a pending read is cut short at the next tick.
+    enum class ExecMode { Auto, Interactive, Stream };
+
+    void exec(ExecMode mode = ExecMode::Auto);
+
+    // True when exec() in Auto mode would stream
+    bool piped() const;
 
     int execc(char c);
 
     void title();
 
+    // Framed machine-control mode: input bytes are parsed as request frames instead of keystrokes,
+    // there is no echo, history or prompt. Also entered with the `frame` command.
+    //   request:  0xA5 len:u16le seq:u8 argv0 '\0' argv1 '\0' ... (len = bytes after seq)
+    //   response: 0xA5 len:u16le seq:u8 status:i16le output (len = output bytes)
+    // Frames can be pipelined, responses come back in request order. A request with len 0 leaves the mode.
+    // Output over 0xffff bytes is cut to that length and the status is QCLI_ERR_BUF, whatever the command returned.
+    int frame_mode(bool on);
+
+    // What a full output buffer does with new output
+    enum class OutPolicy {
+        Block,      // writer waits for the drain thread
+        DropNewest, // output that does not fit is discarded
+        DropOldest, // oldest queued output is discarded to make room
+    };
+
+    // Buffers shell output in `capacity` bytes drained by a background thread, so writers never wait
+    // on a slow sink unless the policy is Block. Dropped bytes are counted and a marker is emitted.
+    // capacity 0 flushes and returns to direct output. Configure before output starts.
+    int output_buffer(size_t capacity, OutPolicy policy = OutPolicy::DropOldest);
+
+    // Total bytes dropped by the output buffer
+    uint64_t output_dropped();
+
+    // Interrupt style input: feed() pushes bytes from a producer context (ISR or reader thread)
+    // into a lock-free ring of `size` bytes (power of two), poll() executes them from the main loop
+    int input_ring(size_t size);
+
+    // Producer side, returns -1 and counts an overrun when the ring is full
+    int feed(char c);
+
+    // Executes at most `budget` queued bytes (0: all available), returns the number processed
+    int poll(size_t budget = 0);
+
+    // Input ring statistics: bytes dropped because the ring was full, and the highest fill level
+    uint32_t input_overruns() const { return ring.overruns; }
+
+    size_t input_high_water() const { return ring.high_water; }
+
+    bool frame_mode() const { return framed; }
+
+    // Bytes written by the core, echo, line editing and messages, as reported by the sink
+    size_t tx_bytes() const;
+
+    // Periodic commands, run every `period_ms` by watch_poll() on a timer wheel with 10 ms ticks
+    // The command line is tokenized once, `redraw` captures each run and repaints it in place at the top of the
+    // screen. Returns the watch id (> 0) or a QCLI_ERR_* code. Call from the thread running the shell.
+    int watch_add(const char *cmdline, uint32_t period_ms, bool redraw = false);
+
+    // Same with the tokens taken as they are, quoted arguments keep their boundaries
+    int watch_add(int argc, char **argv, uint32_t period_ms, bool redraw = false);
+
+    int watch_del(int id);
+
+    // Runs the watches that are due, called by exec() and poll(), returns the number run
+    int watch_poll();
+
+    // Live variables for `var list|get|set|stream`. The application keeps reading and writing `var` as an
+    // ordinary lock-free atomic, the shell uses relaxed loads and stores. `var` must outlive its registration.
+    // Variables can be added and deleted from any thread, deleting one that is being streamed stops the stream.
+    template<typename T>
+        requires std::is_arithmetic_v<T>
+    int var_add(const char *name, std::atomic<T> &var, const char *desc = "")
+    {
+        static_assert(std::atomic<T>::is_always_lock_free, "variable type is not lock-free");
+        return var_add_(name, desc, &var, &var_ops_<T>);
+    }
+
+    // The registration of var_add() as a constant expression, for descriptors in static storage
+    template<typename T>
+        requires std::is_arithmetic_v<T>
+    static constexpr QShellVarDesc var_desc(const char *name, std::atomic<T> &var, const char *desc = "")
+    {
+        static_assert(std::atomic<T>::is_always_lock_free, "variable type is not lock-free");
+        return { name, desc, &var, &var_ops_<T> };
+    }
+
+    // Adds the variables of n descriptors, returns the number added
+    int var_add_many(const QShellVarDesc *descs, size_t n);
+
+    int var_del(const char *name);
+
+    // Samples `names` at `hz` on a background thread and writes them in batches of about 20 ms, as CSV rows
+    // or, with `binary`, as frames of 0xA6 count:u16le followed by count records of the raw values
+    // A header line naming the columns (and their types for binary) comes first. One stream per shell.
+    int var_stream(int n, const char *const *names, uint32_t hz, bool binary = false);
+
+    void var_stream_stop();
+
 private:
+    // Core output is routed through print_hook_ to the shell dispatching on the current thread
+    static thread_local QShell *self_;
+    // Output of the current thread is appended here instead of the sink while set
+    static thread_local std::string *capture_;
+    // Target of core output printed outside of any dispatch, the last initialized shell
+    static QShell *default_;
+
+    // Marks this shell as the one dispatching on the current thread
+    class Scope {
+    public:
+        explicit Scope(QShell *sh) : prev(self_) { self_ = sh; }
+        ~Scope() { self_ = prev; }
+
+    private:
+        QShell *prev;
+    };
+
+    // Epoch based reclamation of commands deleted while other threads dispatch. Readers count themselves in
+    // the phase of the epoch they entered. The epoch only advances once the previous phase has no readers,
+    // so a node retired in epoch e is unreachable to every reader once the epoch reaches e + 2.
+    class ReadGuard {
+    public:
+        explicit ReadGuard(QShell *sh);
+        ~ReadGuard();
+
+    private:
+        QShell *sh;
+        uint64_t epoch;
+    };
+
+    // Locks reg_mtx and records the owning thread, a ReadGuard ending on that thread must not try to lock it again
+    class RegLock {
+    public:
+        explicit RegLock(QShell *sh);
+        ~RegLock();
+
+    private:
+        QShell *sh;
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        QcliCmd *cmd;                  // removed command tree, or null
+        std::vector<QcliCmd *> index;  // replaced index buckets
+        std::shared_ptr<void> hold;    // other storage readers may still use, e.g. a deleted alias
+    };
+
+    // Advances the epoch if possible and releases what no reader can hold, called with reg_mtx held
+    void reclaim_();
+
+    static int print_hook_(const char *fmt, ...);
+
+    // Marks a stage of the shell's own input handling for the profiler, empty without QCLI_PROF
+    class Stage {
+    public:
+#if QCLI_PROF
+        Stage(QShell *sh, QcliStage stage) : sh(sh), stage(stage) { sh->perf_span_(stage, true); }
+        ~Stage() { sh->perf_span_(stage, false); }
+
+    private:
+        QShell *sh;
+        QcliStage stage;
+#else
+        Stage(QShell *, QcliStage) {}
+#endif
+    };
+
+#if QCLI_PROF
+    struct PerfStage {
+        std::atomic<uint64_t> count{ 0 };
+        std::atomic<uint64_t> total{ 0 };
+        std::atomic<uint64_t> max{ 0 };
+        std::array<std::atomic<uint64_t>, PERF_BUCKETS> hist{};
+    };
+
+    // Opens or closes a span of `stage` on the current thread and charges its own time when it closes.
+    // A stage entered again directly inside itself, as core output reaching write_(), is one span.
+    void perf_span_(QcliStage stage, bool enter);
+    // Profiler hook of the core, forwards to the shell dispatching on the current thread
+    static void perf_hook_(Qcli *cli, QcliStage stage, int enter);
+    // `perf [-h]`, `perf reset`
+    static int perf_cb_(int argc, char **argv);
+    static int perf_reset_cb_(int argc, char **argv);
+#endif
+
+    // Writes raw bytes to the capture buffer, the output buffer or the sink
+    void write_(const char *data, size_t len);
+
+    // Writes raw bytes to the user print function, binary safe
+    void sink_(const char *data, size_t len);
+
+    // Bounded output ring shared by writers and the drain thread
+    struct OutQueue {
+        std::mutex mtx;
+        std::condition_variable data_cv;
+        std::condition_variable space_cv;
+        std::vector<char> buf;
+        size_t head{ 0 };
+        size_t size{ 0 };
+        OutPolicy policy{ OutPolicy::DropOldest };
+        uint64_t dropped{ 0 };
+        uint64_t reported{ 0 };
+        bool stop{ false };
+        std::thread thr;
+
+        void push(const char *data, size_t len);
+    };
+    // Bytes written after the queue stopped go straight to the sink
+    void out_enqueue_(OutQueue &q, const char *data, size_t len);
+    std::shared_ptr<OutQueue> outq_();
+    void out_drain_(OutQueue &q);
+
+    // Small stack buffer in front of write_() for the typed print path
+    class OutWriter {
+    public:
+        explicit OutWriter(QShell &sh) : sh(sh) {}
+        ~OutWriter() { flush(); }
+
+        void put(const char *data, size_t len)
+        {
+            if(n + len > sizeof(buf)) {
+                flush();
+                if(len > sizeof(buf)) {
+                    sh.write_(data, len);
+                    total += len;
+                    return;
+                }
+            }
+            memcpy(buf + n, data, len);
+            n += len;
+        }
+
+        // Room for direct formatting, at least `len` bytes
+        char *room(size_t len)
+        {
+            if(n + len > sizeof(buf)) {
+                flush();
+            }
+            return buf + n;
+        }
+
+        void commit(size_t len) { n += len; }
+
+        size_t flush()
+        {
+            if(n > 0) {
+                sh.write_(buf, n);
+                total += n;
+                n = 0;
+            }
+            return total;
+        }
+
+    private:
+        QShell &sh;
+        char buf[256];
+        size_t n{ 0 };
+        size_t total{ 0 };
+    };
+
+    // Literal text of a format, unescaping {{ and }} when the format has them
+    static void fmt_literal_(OutWriter &w, std::string_view s, bool escaped)
+    {
+        if(!escaped) {
+            w.put(s.data(), s.size());
+            return;
+        }
+        for(size_t i = 0; i < s.size(); i++) {
+            w.put(&s[i], 1);
+            if((s[i] == '{' || s[i] == '}') && i + 1 < s.size() && s[i + 1] == s[i]) {
+                i++;
+            }
+        }
+    }
+
+    template<typename T, typename Field>
+    static void fmt_arg_(OutWriter &w, const Field &f, const T &v)
+    {
+        constexpr QShellFmtKind kind = qshell_fmt_kind<T>();
+        if constexpr(kind == QShellFmtKind::Bool) {
+            v ? w.put("true", 4) : w.put("false", 5);
+        } else if constexpr(kind == QShellFmtKind::Char) {
+            w.put(&v, 1);
+        } else if constexpr(kind == QShellFmtKind::Int) {
+            char *p = w.room(24);
+            if constexpr(std::is_enum_v<T>) {
+                auto r = std::to_chars(p, p + 24, (std::underlying_type_t<T>)v, f.spec == 'x' ? 16 : 10);
+                w.commit(r.ptr - p);
+            } else {
+                auto r = std::to_chars(p, p + 24, v, f.spec == 'x' ? 16 : 10);
+                w.commit(r.ptr - p);
+            }
+        } else if constexpr(kind == QShellFmtKind::Float) {
+            // Fixed notation of a large value needs more than the room, scientific always fits
+            constexpr size_t ROOM = QSHELL_FMT_PREC_MAX + 64;
+            char *p = w.room(ROOM);
+            auto r = f.spec == '.' ? std::to_chars(p, p + ROOM, v, std::chars_format::fixed, f.prec)
+                                   : std::to_chars(p, p + ROOM, v);
+            if(r.ec != std::errc()) {
+                r = std::to_chars(p, p + ROOM, v, std::chars_format::scientific, f.prec);
+            }
+            if(r.ec == std::errc()) {
+                w.commit(r.ptr - p);
+            }
+        } else {
+            std::string_view sv;
+            if constexpr(std::is_convertible_v<T, std::string_view>) {
+                sv = v;
+            } else {
+                sv = (const char *)v;
+            }
+            w.put(sv.data(), sv.size());
+        }
+    }
+
+    template<typename Fmt, typename... Args>
+    static void fmt_write_(OutWriter &w, const Fmt &fmt, const Args &...args)
+    {
+        size_t pos = 0;
+        size_t i = 0;
+        auto one = [&](const auto &v) {
+            const auto &f = fmt.fields[i++];
+            fmt_literal_(w, fmt.str.substr(pos, f.begin - pos), fmt.escaped);
+            fmt_arg_(w, f, v);
+            pos = f.end;
+        };
+        (one(args), ...);
+        (void)one;
+        fmt_literal_(w, fmt.str.substr(pos), fmt.escaped);
+    }
+
+    static int frame_cb_(int argc, char **argv);
+
+    // `watch [-n ms] <cmd ...>`, the foreground watch is cancelled by the next key
+    static int watch_cb_(int argc, char **argv);
+
+    // `source [-k] <file>`, see run_script()
+    static int source_cb_(int argc, char **argv);
+
+    // Resolved expansion of an alias, immutable once published and retired when the command tree changes
+    struct AliasBound {
+        CmdHandle h;
+        bool dyn; // an argument picks the command, subcommand or table entry, dispatched on each call
+    };
+
+    // Command node of an alias, its callback finds the alias through the node
+    struct Alias : QcliCmd {
+        std::string name;
+        std::string line;
+        std::string desc;
+        std::vector<std::pair<int, int>> params; // expansion token index, argument number
+        int nargs{ 0 };
+        std::atomic<AliasBound *> bound{ nullptr };
+
+        ~Alias() { delete bound.load(); }
+    };
+
+    // Node callback of every alias
+    static int alias_run_(QcliCmd *cmd, int argc, char **argv);
+    // `alias [name[=line]]`, `unalias <name>`
+    static int alias_cb_(int argc, char **argv);
+    static int unalias_cb_(int argc, char **argv);
+
+    struct ParJob {
+        std::string line;                   // token storage of a line given to par()
+        int argc;
+        char *argv[QCLI_CMD_ARGC_MAX + 1];
+        std::string out;
+        int status;
+        size_t *left;                       // jobs of the batch still running, guarded by the pool mutex
+    };
+
+    struct ParPool {
+        std::mutex mtx;
+        std::condition_variable job_cv;  // a job was queued, or stop
+        std::condition_variable done_cv; // a job finished
+        std::deque<ParJob *> jobs;
+        std::vector<std::thread> threads;
+        bool stop{ false };
+    };
+
+    // Runs the jobs on the pool, the calling thread takes queued jobs too so that nested batches make progress
+    int par_(std::vector<ParJob> &jobs, std::vector<int> *status);
+    void par_run_(ParJob *job);
+    void par_worker_(ParPool &p);
+    // Detaches the pool and joins its workers, batches already running on it finish on their submitters
+    void par_stop_();
+    // `par { a ; b ; c }`, `par 'a ; b ; c'`
+    static int par_cb_(int argc, char **argv);
+
+    struct CacheResult {
+        std::shared_ptr<const std::string> out;
+        int status;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    // Kept with ttl 0 after caching is turned off, the `cache` listing still shows its counters
+    struct CacheEntry {
+        uint32_t ttl;
+        uint64_t hits;
+        uint64_t misses;
+        std::unordered_map<std::string, CacheResult> results;
+    };
+
+    // Node callback of cached commands, the command's own callback stays in the node
+    static int cache_run_(QcliCmd *cmd, int argc, char **argv);
+    // `cache`, `cache clear [path]`
+    static int cache_cb_(int argc, char **argv);
+    static int cache_clear_cb_(int argc, char **argv);
+    // Forgets cmd and its subcommands, called with reg_mtx held before they are deleted
+    void cache_forget_(const QcliCmd *cmd);
+
+    // Called with reg_mtx held
+    int alias_add_(std::string_view name, std::string_view line);
+    int alias_del_(std::string_view name);
+    AliasBound *alias_bind_(Alias *a);
+
+    // Tokenizes a line in place and dispatches it, blank and '#' comment lines return QCLI_EOK
+    int line_(char *line, size_t len);
+
+    void exec_stream_();
+
+    struct WatchLink {
+        WatchLink *prev;
+        WatchLink *next;
+    };
+
+    struct Watch : WatchLink {
+        uint64_t expires;
+        uint32_t period;
+        int id;
+        bool redraw;
+        bool running;
+        bool dead;
+        std::string toks;                  // tokens, each NUL terminated, not bound by QCLI_CMD_STR_MAX
+        int argc;
+        char *argv[QCLI_CMD_ARGC_MAX + 1]; // points into toks
+        std::string line;                  // command line for the redraw header
+    };
+
+    // Hierarchical timing wheel, 4 levels of 64 slots. Level n holds timers due within 64^(n+1) ticks,
+    // a level 0 wrap cascades the next slot of the level above. Insert and remove are O(1).
+    struct TimerWheel {
+        static constexpr unsigned BITS = 6;
+        static constexpr unsigned SLOTS = 1 << BITS;
+        static constexpr unsigned LEVELS = 4;
+        static constexpr uint64_t SPAN = (uint64_t)1 << (BITS * LEVELS);
+
+        WatchLink slot[LEVELS][SLOTS];
+        uint64_t now{ 0 };
+        size_t count{ 0 };
+
+        TimerWheel();
+        void insert(Watch *w);
+        void remove(Watch *w);
+        // Advances one tick and moves the timers due to `due`
+        void step(WatchLink *due);
+    };
+
+    static void link_append_(WatchLink *list, WatchLink *node);
+    static void link_remove_(WatchLink *node);
+
+    // Checks the command of a tokenized watch and puts it on the wheel, returns its id
+    int watch_arm_(std::unique_ptr<Watch> w, uint32_t period_ms, bool redraw);
+    void watch_run_(Watch &w);
+
+    // Cancels the foreground watch or stream on a key press, returns true when the key was consumed
+    bool fg_key_();
+
+    // Ticks since the wheel epoch
+    uint64_t watch_ticks_() const;
+
+    // Milliseconds until the next tick with work, -1 when no watch is armed
+    int watch_timeout_() const;
+
+    struct Var {
+        const char *name;
+        const char *desc;
+        void *ptr;
+        const QShellVarOps *ops;
+    };
+
+    struct VarStream {
+        std::vector<Var> vars;
+        uint32_t hz;
+        bool binary;
+        bool fg;
+        std::atomic<bool> stop{ false };
+        std::thread thr;
+    };
+
+    template<typename T>
+    static size_t var_get_(const void *var, char *buf, size_t n)
+    {
+        T v = static_cast<const std::atomic<T> *>(var)->load(std::memory_order_relaxed);
+        if constexpr(std::is_same_v<T, bool>) {
+            buf[0] = v ? '1' : '0';
+            return 1;
+        } else {
+            auto r = std::to_chars(buf, buf + n, v);
+            return r.ec == std::errc() ? r.ptr - buf : 0;
+        }
+    }
+
+    template<typename T>
+    static bool var_set_(void *var, const char *str)
+    {
+        T v{};
+        if(!QShellArg<T>::parse(str, v)) {
+            return false;
+        }
+        static_cast<std::atomic<T> *>(var)->store(v, std::memory_order_relaxed);
+        return true;
+    }
+
+    template<typename T>
+    static void var_raw_(const void *var, char *out)
+    {
+        T v = static_cast<const std::atomic<T> *>(var)->load(std::memory_order_relaxed);
+        memcpy(out, &v, sizeof(T));
+    }
+
+    template<typename T>
+    static constexpr QShellVarOps var_ops_ = { qshell_var_type<T>(), sizeof(T), var_get_<T>, var_set_<T>, var_raw_<T> };
+
+    int var_add_(const char *name, const char *desc, void *ptr, const QShellVarOps *ops);
+    // fg: started from the prompt, a key stops it
+    int var_stream_(int n, const char *const *names, uint32_t hz, bool binary, bool fg);
+    // var_mtx held
+    void var_stream_stop_();
+
+    // Sorted by name
+    // var_mtx held
+    std::vector<Var>::iterator var_find_(const char *name);
+
+    void var_stream_run_(VarStream &st);
+
+    static int var_cb_(int argc, char **argv);
+    static int var_list_cb_(int argc, char **argv);
+    static int var_get_cb_(int argc, char **argv);
+    static int var_set_cb_(int argc, char **argv);
+    static int var_stream_cb_(int argc, char **argv);
+    void frame_feed_(uint8_t c);
+    void frame_exec_();
+
+    // Slab allocator for shell owned command nodes
+    // Slabs grow geometrically and are never moved, freed nodes are kept on an intrusive free list
+    class CmdPool {
+    public:
+        QcliCmd *alloc();
+        // Contiguous run of n nodes carved from a dedicated slab
+        QcliCmd *alloc_n(size_t n);
+        void free(QcliCmd *cmd);
+        // Nodes are tagged with their pool when handed out, so this does not search the slabs
+        bool owns(const QcliCmd *cmd) const;
+        size_t used() const { return used_; }
+
+    private:
+        union Slot {
+            QcliCmd cmd;
+            Slot *next;
+        };
+        static constexpr size_t SLAB_MIN = 64;
+        std::vector<std::pair<std::unique_ptr<Slot[]>, size_t>> slabs;
+        // Size of the next free list slab, doubled on each growth, bulk slabs of alloc_n() do not count
+        size_t grow{ SLAB_MIN };
+        Slot *free_list{ nullptr };
+        size_t used_{ 0 };
+    };
+
+    // Returns a node and its subcommands to the pool, nodes not owned by the shell are skipped
+    void cmd_release_(QcliCmd *cmd);
+
+    // Grows the command index so that n commands keep short bucket chains
+    void index_reserve_(size_t n);
+
+    // Generated per handler type: checks arity, converts argv[Skip...] and calls F
+    template<typename F, typename Args, int Skip>
+    static int typed_cb_(int argc, char **argv)
+    {
+        constexpr int n = (int)std::tuple_size_v<Args>;
+        if(argc - Skip < n) {
+            return QCLI_ERR_PARAM_LESS;
+        } else if(argc - Skip > n) {
+            return QCLI_ERR_PARAM_MORE;
+        }
+        Args args{};
+        bool ok = [&]<size_t... I>(std::index_sequence<I...>) {
+            return (QShellArg<std::tuple_element_t<I, Args>>::parse(argv[Skip + I], std::get<I>(args)) && ...);
+        }(std::make_index_sequence<n>{});
+        if(!ok) {
+            return QCLI_ERR_PARAM_TYPE;
+        }
+        if constexpr(std::is_void_v<decltype(std::apply(F{}, args))>) {
+            std::apply(F{}, args);
+            return QCLI_EOK;
+        } else {
+            return (int)std::apply(F{}, args);
+        }
+    }
+
+    // Typed arguments of a subcommand start after its path, pick the trampoline skipping that many tokens
+    template<typename F, typename Args>
+    static QShellCmdHandler typed_sub_cb_(const char *parent_name)
+    {
+        static constexpr auto cbs = []<size_t... I>(std::index_sequence<I...>) {
+            return std::array<QShellCmdHandler, sizeof...(I)>{ typed_cb_<F, Args, (int)I + 1>... };
+        }(std::make_index_sequence<QCLI_CMD_ARGC_MAX>{});
+        size_t skip = path_depth_(parent_name) + 1;
+        return (skip >= 1 && skip <= cbs.size()) ? cbs[skip - 1] : nullptr;
+    }
+
+    // Number of names in a space separated command path
+    static size_t path_depth_(const char *path);
+
     // Shell initialization flag
     bool inited = false;
 
@@ -96,10 +1211,75 @@ private:
     // CLI object for handling command line interface operations
     Qcli cli;
 
-    std::vector<uintptr_t> cmds_addr;
+    CmdPool pool;
+
+    // Command index buckets once the built-in ones of Qcli are outgrown
+    std::vector<QcliCmd *> buckets;
+
+    // Serializes writers of the command tree through RegLock, readers only use the epoch counters
+    std::mutex reg_mtx;
+    std::atomic<std::thread::id> reg_owner{};
+    std::atomic<uint64_t> epoch{ 0 };
+    std::atomic<uint32_t> readers[2]{};
+    std::atomic<size_t> retired_n{ 0 };
+    std::vector<Retired> retired;
 
     // Function pointer to the get character function
     GetChFunc getch;
+
+    // User print function, the sink of all shell output
+    QcliPrint out{ nullptr };
+
+    // Output buffer, direct output when null, guarded by outq_mtx. Writers hold a reference while they
+    // enqueue, so the queue stays valid while output_buffer() replaces it. buffered spares unbuffered writes
+    // the lock.
+    std::mutex outq_mtx;
+    std::shared_ptr<OutQueue> outq;
+    std::atomic<bool> buffered{ false };
+
+    // Help text caches of the core, one per mode
+    std::vector<char> help_buf[2];
+
+    // Input ring for feed()/poll()
+    QcliRing ring{};
+    std::vector<uint8_t> ring_buf;
+
+    // Framed mode state, frame_rx collects the request being received
+    bool framed{ false };
+    std::string frame_rx;
+    std::string frame_out;
+
+    // Watches by id, armed on the wheel unless running
+    TimerWheel wheel;
+    std::unordered_map<int, std::unique_ptr<Watch>> watches;
+    std::chrono::steady_clock::time_point wheel_epoch{ std::chrono::steady_clock::now() };
+    int watch_seq{ 0 };
+    int watch_fg{ 0 };
+    std::string watch_out;
+    std::string watch_frame;
+
+    // Variables sorted by name and the running stream, guarded by var_mtx
+    std::mutex var_mtx;
+    std::vector<Var> vars;
+    std::unique_ptr<VarStream> stream;
+
+    // Aliases by name, changed with reg_mtx held
+    std::map<std::string, std::unique_ptr<Alias>, std::less<>> aliases;
+
+    // Cached commands by node, guarded by cache_mtx
+    std::mutex cache_mtx;
+    std::unordered_map<const QcliCmd *, CacheEntry> cache;
+
+    // Worker pool of par(), started on first use. Batches hold a reference, workers and par_n are guarded by
+    // par_mtx.
+    std::mutex par_mtx;
+    std::shared_ptr<ParPool> workers;
+    size_t par_n{ 0 };
+
+#if QCLI_PROF
+    // Per-stage profile, updated by every dispatching thread
+    std::array<PerfStage, QCLI_STAGE_NUM> perf;
+#endif
 };
 
 #endif
@@ -0,0 +1,360 @@
+/**
+ * @ Author: luoqi
+ * @ Create Time: 2026-10-19 12:00
+ * @ Modified by: luoqi
+ * @ Modified time: 2026-10-19 12:00
+ * @ Description: Regression checks of the core and QShell, run by ctest
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "qshell.h"
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+static std::mutex out_mtx;
+static std::string out;
+static std::vector<std::string> calls;
+
+// Collects the output, the shell hands raw bytes over as "%.*s". Streams write from their own thread.
+static int sink(const char *fmt, ...)
+{
+    std::lock_guard<std::mutex> lock(out_mtx);
+    va_list args;
+    va_start(args, fmt);
+    int n;
+    if(strcmp(fmt, "%.*s") == 0) {
+        n = va_arg(args, int);
+        out.append(va_arg(args, const char *), n);
+    } else {
+        char buf[512];
+        n = vsnprintf(buf, sizeof(buf), fmt, args);
+        out.append(buf, n > 0 ? std::min<size_t>(n, sizeof(buf) - 1) : 0);
+    }
+    va_end(args);
+    return n;
+}
+
+// Records each call as its tokens in brackets, e.g. "[echo][a b]"
+static int echo(int argc, char **argv)
+{
+    std::string s;
+    for(int i = 0; i < argc; i++) {
+        s.append("[").append(argv[i]).append("]");
+    }
+    calls.push_back(s);
+    return 0;
+}
+
+static int failed;
+
+static void check(bool ok, const char *what)
+{
+    if(!ok) {
+        printf(" FAIL: %s\r\n", what);
+        failed++;
+    }
+}
+
+static bool called(std::initializer_list<const char *> expect)
+{
+    bool ok = calls.size() == expect.size() && std::equal(calls.begin(), calls.end(), expect.begin());
+    calls.clear();
+    return ok;
+}
+
+// Quoted operators are arguments, only tokenizer operators split a sequence
+static void test_quoted_op(QShell &sh)
+{
+    sh.xstr("echo ';' x");
+    check(called({ "[echo][;][x]" }), "quoted ; is an argument");
+    sh.xstr("echo a ; echo b");
+    check(called({ "[echo][a]", "[echo][b]" }), "; splits a sequence");
+    sh.xstr("echo '&&' && echo '||'");
+    check(called({ "[echo][&&]", "[echo][||]" }), "quoted && and || are arguments");
+
+    sh.par({ "echo '||' y" });
+    check(called({ "[echo][||][y]" }), "quoted || in par()");
+
+    sh.alias_add("qa", "echo '&&' z");
+    sh.xstr("qa");
+    check(called({ "[echo][&&][z]" }), "quoted && in an alias");
+    sh.alias_del("qa");
+
+    // argv built by the caller, e.g. from a framed request
+    Qcli cli;
+    QcliCmd cmd;
+    qcli_init(&cli, sink);
+    qcli_add(&cli, &cmd, "echo", echo, "record arguments");
+    char a0[] = "echo", a1[] = ";", a2[] = "x";
+    char *argv[] = { a0, a1, a2, nullptr };
+    qcli_dispatch(&cli, 3, argv);
+    check(called({ "[echo][;][x]" }), "a caller's ; is not an operator");
+}
+
+static QShell *shell;
+
+static int big(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    std::string line(1000, 'x');
+    for(int i = 0; i < 70; i++) {
+        shell->print("%s", line.c_str());
+    }
+    return 0;
+}
+
+static void type(QShell &sh, const std::string &s)
+{
+    for(char c : s) {
+        sh.execc(c);
+    }
+}
+
+static std::string request(uint8_t seq, const std::string &payload)
+{
+    std::string f = { (char)0xa5, (char)(payload.size() & 0xff), (char)(payload.size() >> 8), (char)seq };
+    return f + payload;
+}
+
+// The typed `frame` command leaves nothing after its line, output over the length field fails the request
+static void test_frame(QShell &sh)
+{
+    sh.cmd_add("big", big, "70000 bytes of output");
+    out.clear();
+    type(sh, "frame\r");
+    check(sh.frame_mode() && out.size() >= 2 && out.compare(out.size() - 2, 2, "\r\n") == 0,
+        "no prompt after frame");
+
+    out.clear();
+    type(sh, request(7, std::string("big", 4)));
+    check(out.size() == 6 + 0xffff && (uint8_t)out[1] == 0xff && (uint8_t)out[2] == 0xff && out[3] == 7 &&
+              (int16_t)((uint8_t)out[4] | (uint8_t)out[5] << 8) == QCLI_ERR_BUF,
+        "cut output reports QCLI_ERR_BUF");
+
+    out.clear();
+    type(sh, request(8, std::string("echo\0a", 6)));
+    check(out.size() == 6 && out[4] == 0 && out[5] == 0 && called({ "[echo][a]" }), "short output is complete");
+
+    type(sh, request(9, ""));
+    check(!sh.frame_mode(), "len 0 leaves framed mode");
+    sh.cmd_del("big");
+}
+
+// Recalling history sends only the differing tail of the line, QCLI_REDRAW_DIFF=0 reprints the whole line
+static void test_redraw()
+{
+    QShell sh(sink, nullptr);
+    sh.cmd_add("led", echo, "led");
+    sh.cmd_add("ledstrip", echo, "led strip");
+    type(sh, "led on 1\rled off 2\rledstrip\r\x1b[A\x1b[A\x1b[A\x1b[B\x1b[B\x1b[B");
+    calls.clear();
+    size_t before = sh.tx_bytes();
+    for(int i = 0; i < 100; i++) {
+        type(sh, i % 6 < 3 ? "\x1b[A" : "\x1b[B");
+    }
+    check(sh.tx_bytes() - before == (QCLI_REDRAW_DIFF ? 916 : 1506), "bytes of 100 history keys");
+}
+
+// Script lines are tokenized into the script, not limited to QCLI_CMD_STR_MAX
+static void test_script(QShell &sh)
+{
+    std::string arg(2 * QCLI_CMD_STR_MAX, 'a');
+    std::string src = "repeat 2 {\n  echo " + arg + " $x 'b c'\n}\n";
+    QShell::Script s;
+    check(s.compile(sh, src) == 0 && s.run() == QCLI_EOK, "long script line");
+    std::string expect = "[echo][" + arg + "][][b c]";
+    check(calls.size() == 2 && calls[0] == expect && calls[1] == expect, "long script line arguments");
+    calls.clear();
+}
+
+// One thread feeds the input ring while another polls it: nothing is lost or reordered across many wraps, a full
+// ring counts each dropped byte and the consumer records the highest fill level
+static void test_ring(QShell &sh)
+{
+    check(sh.input_ring(16) == 0, "input_ring");
+    int dropped = 0;
+    for(int i = 0; i < 20; i++) {
+        dropped += sh.feed('#') != 0;
+    }
+    check(dropped == 4 && sh.input_overruns() == 4, "overruns of a full ring");
+    check(sh.poll() == 16 && sh.input_high_water() == 16, "high water of a full ring");
+    type(sh, "\r");
+
+    const int n = 2000;
+    check(sh.input_ring(64) == 0, "input_ring");
+    calls.clear();
+    int retries = 0;
+    std::thread producer([&] {
+        for(int i = 0; i < n; i++) {
+            std::string line = "echo " + std::to_string(i) + "\r";
+            for(char c : line) {
+                while(sh.feed(c) != 0) {
+                    retries++;
+                    std::this_thread::yield();
+                }
+            }
+        }
+    });
+    while(calls.size() < (size_t)n) {
+        if(sh.poll(7) == 0) {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    bool ordered = true;
+    for(int i = 0; i < n; i++) {
+        ordered = ordered && calls[i] == "[echo][" + std::to_string(i) + "]";
+    }
+    check(ordered, "ring delivers every byte in order");
+    check(sh.input_overruns() == (uint32_t)retries, "overruns count the rejected pushes");
+    check(sh.input_high_water() > 0 && sh.input_high_water() <= 64, "high water within the ring");
+    calls.clear();
+}
+
+// An alias runs through its node, also from a compiled handle, and cmd_del() on it removes the alias
+static void test_alias(QShell &sh)
+{
+    check(sh.alias_add("al", "echo $1 x") == QCLI_EOK, "alias_add");
+    QShell::CmdHandle h;
+    check(sh.compile(h, "al a") == QCLI_EOK && sh.invoke(h) == QCLI_EOK, "compiled alias");
+    sh.xstr("al b");
+    check(called({ "[echo][a][x]", "[echo][b][x]" }), "alias expansion");
+
+    sh.cmd_del("al");
+    out.clear();
+    sh.xstr("alias");
+    check(out.find("echo $1 x") == std::string::npos, "cmd_del removes the alias");
+    check(sh.alias_add("al", "echo y") == QCLI_EOK, "alias added again");
+    sh.xstr("al");
+    check(called({ "[echo][y]" }), "new alias runs");
+    sh.alias_del("al");
+}
+
+// A full key map of a cached command drops its oldest result, the others still hit
+static void test_cache(QShell &sh)
+{
+    sh.cmd_add("cached", echo, "cached");
+    check(sh.cmd_cache("cached", 60000) == QCLI_EOK, "cmd_cache");
+    for(int i = 0; i <= 64; i++) {
+        sh.xstr("cached " + std::to_string(i));
+    }
+    calls.clear();
+    sh.xstr("cached 64");
+    sh.xstr("cached 1");
+    check(called({}), "recent results hit");
+    sh.xstr("cached 0");
+    check(called({ "[cached][0]" }), "oldest result evicted");
+    QShell::CacheStats st = sh.cache_stats("cached");
+    check(st.hits == 2 && st.misses == 66 && st.entries == 64, "cache counters");
+    check(sh.cmd_cache("cached", 0) == QCLI_EOK, "caching off");
+    sh.xstr("cached 64");
+    check(called({ "[cached][64]" }), "command runs again");
+    sh.cmd_del("cached");
+}
+
+static size_t out_size()
+{
+    std::lock_guard<std::mutex> lock(out_mtx);
+    return out.size();
+}
+
+// Deleting a variable that a stream samples stops the stream before the application destroys it
+static void test_var(QShell &sh)
+{
+    auto x = std::make_unique<std::atomic<int>>(5);
+    check(sh.var_add("x", *x) == 0, "var_add");
+    out.clear();
+    sh.xstr("var get x");
+    check(out.find(" x = 5") != std::string::npos, "var get");
+
+    const char *names[] = { "x" };
+    check(sh.var_stream(1, names, 1000) == QCLI_EOK, "var_stream");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    check(sh.var_del("x") == 0, "var_del");
+    x.reset();
+    size_t n = out_size();
+    check(n > 0, "stream wrote samples");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    check(out_size() == n, "deleting a streamed variable stops the stream");
+}
+
+static std::atomic<int> rpm{ 3 };
+
+// Descriptors and nodes in static storage, as the linker sections of CmdMgr provide them
+static void test_static(QShell &sh)
+{
+    static QcliDesc descs[] = { { "st", "sub", echo, "sub" }, { nullptr, "st", echo, "top" } };
+    static QcliCmd nodes[2];
+    check(sh.cmd_add_many(descs, nodes, 2) == 2, "cmd_add_many on static nodes");
+    sh.xstr("st sub a");
+    check(called({ "[st][sub][a]" }), "static subcommand");
+    check(sh.cmd_del("st") == QCLI_EOK, "delete static command");
+    sh.xstr("st sub");
+    check(called({}), "static command is gone");
+
+    static constexpr QShellVarDesc vars[] = { QShell::var_desc("rpm", rpm, "speed") };
+    check(sh.var_add_many(vars, 1) == 1, "var_add_many");
+    sh.xstr("var set rpm 9");
+    check(rpm.load() == 9, "static variable");
+    sh.var_del("rpm");
+}
+
+#ifndef _WIN32
+// Streamed input runs watches between blocks, also while no line arrives
+static void test_stream_watch(QShell &sh)
+{
+    int fds[2];
+    check(pipe(fds) == 0, "pipe");
+    int in = dup(STDIN_FILENO);
+    dup2(fds[0], STDIN_FILENO);
+    close(fds[0]);
+    std::thread writer([fd = fds[1]] {
+        const char start[] = "watch -n 100 echo w\n";
+        write(fd, start, sizeof(start) - 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(550));
+        close(fd);
+    });
+    sh.exec(QShell::ExecMode::Stream);
+    writer.join();
+    dup2(in, STDIN_FILENO);
+    close(in);
+    size_t runs = std::count(calls.begin(), calls.end(), "[echo][w]");
+    calls.clear();
+    check(runs >= 3 && runs <= 6, "watch runs in stream mode");
+}
+#endif
+
+int main()
+{
+    QShell sh(sink, nullptr);
+    shell = &sh;
+    sh.cmd_add("echo", echo, "record arguments");
+    test_quoted_op(sh);
+    test_frame(sh);
+    test_var(sh);
+    test_static(sh);
+    test_redraw();
+    test_script(sh);
+    test_ring(sh);
+    test_alias(sh);
+    test_cache(sh);
+#ifndef _WIN32
+    test_stream_watch(sh);
+#endif
+    if(failed == 0) {
+        printf(" all checks passed\r\n");
+    }
+    return failed == 0 ? 0 : 1;
+}